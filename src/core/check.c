@@ -0,0 +1,241 @@
+/*
+ * core/check.c -- Golden frame checks.
+ *
+ * Compares each frame drawn in a headless run against golden images stored as
+ * PPM files, writing those missing and a diff image for each mismatch, and
+ * times each frame; each run ends with one line of report.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "core/check.h"
+#include "core/core.h"
+#include "core/vpu/vpu.h"
+#include "core/vpu/simd.h"
+#include "log.h"
+
+int mark_done();
+
+static void core_check__path(struct core_check *, char *, size_t,
+        const char *);
+static int core_check__read_ppm(const char *, uint8_t *);
+static int core_check__write_ppm(const char *, const uint8_t *);
+static void core_check__diff(struct core_check *);
+
+
+/*
+ * Start checking the frames of the ROM in file rom, as the options given say,
+ * drawn by vpu.
+ */
+int core_check_init(struct core_check **pcheck, const char *rom,
+        const struct core_options *opts, struct core_vpu *vpu)
+{
+    struct core_check *check;
+    const char *base = strrchr(rom, '/');
+    char skip[24] = "";
+    size_t len;
+
+    *pcheck = check = calloc(1, sizeof(struct core_check));
+    if(check == NULL) {
+        LOGE("Could not allocate the frame checks");
+        return 0;
+    }
+    check->dir = opts->golden_dir;
+    check->frames = opts->frames;
+    check->lines_timed = vpu->renderer != VPU_RENDER_CYCLE;
+    check->ns_min = UINT64_MAX;
+    check->hash = 1469598103934665603ull;
+    check->start_ns = core_vpu_now_ns();
+
+    base = base != NULL ? base + 1 : rom;
+    len = strcspn(base, ".");
+    snprintf(check->name, sizeof(check->name), "%.*s", (int)len, base);
+    if(opts->draw_every == 0)
+        snprintf(skip, sizeof(skip), "+skip=all");
+    else if(opts->draw_every > 1)
+        snprintf(skip, sizeof(skip), "+skip=%d", opts->draw_every);
+    snprintf(check->variant, sizeof(check->variant), "%s%s%s%s%s%s/%s",
+            vpu->renderer == VPU_RENDER_CYCLE ? "cycle" : "scanline",
+            vpu->output == VPU_OUTPUT_INDEXED ? "+indexed" : "",
+            vpu->fetch == VPU_FETCH_BLOCK ? "+block-fetch" : "",
+            opts->render_thread ? "+render-thread" : "",
+            opts->lazy_sync ? "+lazy-sync" : "", skip,
+            vpu->simd->name);
+
+    if(check->dir != NULL && mkdir(check->dir, 0777) < 0 && errno != EEXIST) {
+        LOGE("Could not create golden image directory '%s'", check->dir);
+        free(check);
+        *pcheck = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Check a frame drawn, as a VPU frame observer; frames skipped only count. The
+ * run is over once there were enough frames; any after that are left alone.
+ */
+void core_check_frame(void *ctx, const void *fb, int output,
+        const struct core_vpu_stats *stats)
+{
+    struct core_check *check = ctx;
+    uint64_t t = core_vpu_now_ns();
+    char fn[4096];
+    int i;
+
+    if(check->frames > 0 && check->frame >= check->frames)
+        return;
+    check->all_ns = t - check->start_ns - check->check_ns;
+    check->ns_sum += stats->host_ns;
+    if(stats->host_ns < check->ns_min)
+        check->ns_min = stats->host_ns;
+    if(stats->host_ns > check->ns_max)
+        check->ns_max = stats->host_ns;
+    if(fb == NULL) {
+        check->skipped += 1;
+        goto l_next;
+    }
+
+    if(output == VPU_OUTPUT_INDEXED)
+        core_vpu_expand_indexed(check->px, fb, VPU_XRES * VPU_YRES);
+    else
+        memcpy(check->px, fb, sizeof(check->px));
+    for(i = 0; i < VPU_XRES * VPU_YRES; ++i) {
+        check->rgb[i*3 + 0] = check->px[i].r;
+        check->rgb[i*3 + 1] = check->px[i].g;
+        check->rgb[i*3 + 2] = check->px[i].b;
+    }
+    for(i = 0; i < (int)sizeof(check->rgb); ++i)
+        check->hash = (check->hash ^ check->rgb[i]) * 1099511628211ull;
+
+    if(check->dir != NULL) {
+        core_check__path(check, fn, sizeof(fn), "");
+        if(!core_check__read_ppm(fn, check->golden)) {
+            if(core_check__write_ppm(fn, check->rgb))
+                check->written += 1;
+        } else if(memcmp(check->golden, check->rgb, sizeof(check->rgb))) {
+            LOGW("core.check: frame %d differs from '%s'", check->frame, fn);
+            check->mismatched += 1;
+            core_check__diff(check);
+        }
+    }
+
+l_next:
+    check->frame += 1;
+    if(check->frames > 0 && check->frame == check->frames)
+        mark_done();
+    check->check_ns += core_vpu_now_ns() - t;
+}
+
+
+/*
+ * Report on the run, and free the checks. Returns 1 if every frame asked for
+ * was checked and matched its golden image, otherwise 0.
+ */
+int core_check_end(struct core_check *check)
+{
+    int n = check->frame > 0 ? check->frame : 1;
+    int ok;
+
+    ok = check->mismatched == 0 && check->frame >= check->frames;
+    printf("%s %s: %d frames (%d skipped), hash %016llx, %d mismatched, %d written; "
+           "all %.3f ms/frame",
+           check->name, check->variant, check->frame, check->skipped,
+           (unsigned long long)check->hash, check->mismatched, check->written,
+           check->all_ns / 1e6 / n);
+    if(check->lines_timed)
+        printf(", scanline drawing %.3f ms/frame (%.3f-%.3f)",
+               check->ns_sum / 1e6 / n,
+               check->frame > 0 ? check->ns_min / 1e6 : 0.0,
+               check->ns_max / 1e6);
+    printf("%s\n", ok ? "" : " FAILED");
+    fflush(stdout);
+    free(check);
+    return ok;
+}
+
+
+/*
+ * The path of the current frame's golden image, or of another image of it,
+ * its name ending with suffix.
+ */
+static void core_check__path(struct core_check *check, char *fn, size_t n,
+        const char *suffix)
+{
+    snprintf(fn, n, "%s/%s-%04d%s.ppm", check->dir, check->name, check->frame,
+            suffix);
+}
+
+
+/* Read a frame's worth of RGB from a PPM file. Returns 0 if there is none. */
+static int core_check__read_ppm(const char *fn, uint8_t *rgb)
+{
+    FILE *f = fopen(fn, "rb");
+    int w, h, max, ok;
+
+    if(f == NULL)
+        return 0;
+    ok = fscanf(f, "P6 %d %d %d", &w, &h, &max) == 3 &&
+        w == VPU_XRES && h == VPU_YRES && max == 255 && fgetc(f) != EOF &&
+        fread(rgb, 3, VPU_XRES * VPU_YRES, f) == VPU_XRES * VPU_YRES;
+    fclose(f);
+    if(!ok)
+        LOGW("core.check: '%s' is not a %dx%d golden image", fn, VPU_XRES,
+                VPU_YRES);
+    return ok;
+}
+
+
+static int core_check__write_ppm(const char *fn, const uint8_t *rgb)
+{
+    FILE *f = fopen(fn, "wb");
+
+    if(f == NULL) {
+        LOGE("Could not open '%s' for writing", fn);
+        return 0;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", VPU_XRES, VPU_YRES);
+    fwrite(rgb, 3, VPU_XRES * VPU_YRES, f);
+    if(fclose(f) != 0) {
+        LOGE("Could not write '%s'", fn);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Write a diff image next to the golden one, named after the variant: pixels
+ * which differ in red, over the golden image darkened.
+ */
+static void core_check__diff(struct core_check *check)
+{
+    uint8_t *diff = check->golden;
+    char suffix[112], fn[4096];
+    char *k;
+    int i;
+
+    for(i = 0; i < VPU_XRES * VPU_YRES * 3; i += 3) {
+        if(memcmp(check->golden + i, check->rgb + i, 3)) {
+            diff[i] = 255;
+            diff[i + 1] = diff[i + 2] = 0;
+        } else {
+            diff[i] /= 4;
+            diff[i + 1] /= 4;
+            diff[i + 2] /= 4;
+        }
+    }
+    snprintf(suffix, sizeof(suffix), "-%s-diff", check->variant);
+    for(k = suffix; *k != '\0'; ++k)
+        if(*k == '/' || *k == '+')
+            *k = '_';
+    core_check__path(check, fn, sizeof(fn), suffix);
+    core_check__write_ppm(fn, diff);
+}
+
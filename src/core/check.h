@@ -0,0 +1,66 @@
+/*
+ * core/check.h -- Golden frame checks (header).
+ *
+ * Declares the state kept while comparing each frame drawn against stored
+ * golden images, and timing the VPU, over a headless run.
+ *
+ */
+
+#ifndef QPRA_CORE_CHECK_H
+#define QPRA_CORE_CHECK_H
+
+#include <stdint.h>
+
+#include "core/vpu/vpu.h"
+
+struct core_options;
+
+struct core_check
+{
+    /* Where the golden images are, or NULL to only hash and time frames. */
+    const char *dir;
+    /* The ROM's file name, without directory or extension. */
+    char name[64];
+    /* The renderer variant run, for the report. */
+    char variant[96];
+
+    /* Frames to check, or 0 for all of them; and how many were. */
+    int frames;
+    int frame;
+    /* Frames not drawn, which are counted but not checked. */
+    int skipped;
+    /* Frames which differed from their golden image, and images written. */
+    int mismatched;
+    int written;
+    /* A hash over every frame checked. */
+    uint64_t hash;
+    /*
+     * VPU host time per frame drawing lines: in all, and the least and most.
+     * Only the scanline renderer is timed so; the cycle renderer draws a pixel
+     * at a time, too fine to time.
+     */
+    int lines_timed;
+    uint64_t ns_sum;
+    uint64_t ns_min;
+    uint64_t ns_max;
+    /*
+     * Host time from the start to the last frame checked, less that spent
+     * checking: the figure to compare across variants.
+     */
+    uint64_t start_ns;
+    uint64_t check_ns;
+    uint64_t all_ns;
+
+    /* The frame as RGB, and its golden image. */
+    struct rgba px[VPU_XRES * VPU_YRES];
+    uint8_t rgb[VPU_XRES * VPU_YRES * 3];
+    uint8_t golden[VPU_XRES * VPU_YRES * 3];
+};
+
+int core_check_init(struct core_check **, const char *,
+        const struct core_options *, struct core_vpu *);
+void core_check_frame(void *, const void *, int, const struct core_vpu_stats *);
+int core_check_end(struct core_check *);
+
+#endif
+
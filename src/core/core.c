@@ -11,10 +11,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "core/core.h"
+#include "core/check.h"
 #include "core/cpu/cpu.h"
 //#include "core/apu/apu.h"
 #include "core/vpu/vpu.h"
+#include "core/vpu/simd.h"
 #include "core/mmu/mmu.h"
 #include "core/cart/cart.h"
 //#include "core/pad/pad.h"
@@ -22,8 +29,21 @@
 
 int done();
 
+static void core_run_commands(struct core_system *);
+static int core_parse_range(const char *, unsigned int *, unsigned int *);
+static void core_parse_options(struct core_options *, int, char **);
+static void core_free_temp_banks(struct core_temp_banks *);
+static int core_load_rom(struct core_system *, const char *,
+        struct core_temp_banks *);
+static int core_load_palette(struct core_system *, uint8_t *);
+
 const char *palette_fn = "palette.bin";
 
+/* Commands posted from other threads, for the core thread to run. */
+static pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cmd_queue[CORE_CMD_MAX][CORE_CMD_LEN];
+static int cmd_num;
+
 struct arg_pair
 {
     int argc;
@@ -34,34 +54,45 @@ struct arg_pair
 /*
  * Emulation thread entry point.
  * Parses the command line, loads the ROM (if any) and begins emulation.
+ * Returns NULL once done, or non-NULL if the core could not start, or its
+ * frames failed their checks.
  */
 void *core_entry(void *data)
 {
     struct core_system *core;
     struct core_temp_banks banks;
     struct timespec ts0, ts1, ts_sleep;
+    struct core_vpu_stats vs;
     unsigned int frame = 0;
     intmax_t us, us_sum = 0;
     int cycles = 0;
+    int ok = 1;
 
     struct arg_pair *pair = (struct arg_pair *)data;
     
-    core = malloc(sizeof(struct core_system));
+    core = calloc(1, sizeof(struct core_system));
     if(core == NULL) {
         LOGE("Could not allocate core structure");
-        return 0;
+        return (void *)1;
     }
+    memset(&banks, 0, sizeof(banks));
+    core_parse_options(&core->opts, pair->argc, pair->argv);
 
     if(pair->argv[1][0] != '-' && core_load_rom(core, pair->argv[1], &banks)) {
         LOGD("Loaded ROM file '%s' successfully", pair->argv[1]);
     } else {
         LOGD("Couldn't load a ROM file");
+        if(core->opts.headless) {
+            free(core);
+            return (void *)1;
+        }
     }
 
     if(!core_init(core, &banks)) {
         LOGE("System initialization failed; exiting");
-        return NULL;
+        return (void *)1;
     }
+    core_run_commands(core);
 
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts0);
     LOGD("Beginning emulation");
@@ -74,8 +105,11 @@ void *core_entry(void *data)
         do {
             /* Apply any pending read/write requests on the bus. */
             core_mmu_update(core->cpu->mmu);
-            /* Execute a cycle in the VPU. */
-            core_vpu_cycle(core->vpu, core->cpu->total_cycles);
+            /* Execute a cycle in the VPU, or catch it up once it is due. */
+            if(core->vpu->sync == VPU_SYNC_LOCKSTEP)
+                core_vpu_cycle(core->vpu, core->cpu->total_cycles);
+            else if(core->cpu->total_cycles >= core->vpu->deadline)
+                core_vpu_sync(core->vpu, core->cpu->total_cycles + 1);
             /* Execute an instruction cycle in the CPU. */
             core_cpu_i_cycle(core->cpu);
             LOGV("core.cpu: ... cycle %d", core->cpu->i_cycles);
@@ -92,6 +126,7 @@ void *core_entry(void *data)
               LOGV("core.cpu: skipping to vblank");
               core->cpu->total_cycles = core_vpu_debug_skip_to_vblank(core->vpu, core->cpu->total_cycles);
            }
+           core_run_commands(core);
         }
 #else
         
@@ -107,15 +142,27 @@ void *core_entry(void *data)
             if(++frame == 60) {
                 us_sum /= 60;
                 LOGD("frame avg: % 3d.%03d ms", us_sum / 1000, us_sum % 1000);
+                core_vpu_get_stats(core->vpu, &vs);
+                LOGD("vpu frame %u: %u lines drawn, %u skipped, "
+                     "sprites/line %u-%u (%u.%02u avg), %u fetches, "
+                     "%u writes denied, % 3d.%03d ms",
+                     vs.frame, vs.lines_drawn, vs.lines_skipped,
+                     vs.sprites_min, vs.sprites_max,
+                     vs.sprites_sum / VPU_YRES, vs.sprites_sum % VPU_YRES * 100 / VPU_YRES,
+                     vs.fetches, vs.writes_denied,
+                     (int)(vs.host_ns / 1000000), (int)(vs.host_ns / 1000 % 1000));
                 us_sum = frame = 0;
             }
 
-            if(us < 16666) {
+            if(us < 16666 && !core->opts.headless) {
                 ts_sleep.tv_sec = 0;
                 ts_sleep.tv_nsec = 16666666 - (us * 1000);
                 nanosleep(&ts_sleep, NULL);
             }
             
+            core_vpu_sync(core->vpu, core->cpu->total_cycles);
+            core_mmu_stats_frame(core->mmu);
+            core_run_commands(core);
             clock_gettime(CLOCK_MONOTONIC_RAW, &ts0);
             cycles = 0;
         }
@@ -123,9 +170,12 @@ void *core_entry(void *data)
     }
     LOGD("Finished emulation");
     core_destroy(core);
+    if(core->check != NULL)
+        ok = core_check_end(core->check);
     free(core);
 
     LOGD("Emulation core thread exiting");
+    return ok ? NULL : (void *)1;
 }
 
 
@@ -142,8 +192,12 @@ int core_init(struct core_system *core, struct core_temp_banks *banks)
     mmup.ram_banks = core->header->ram_banks;
     mmup.tile_banks = core->header->tile_banks;
     mmup.dpcm_banks = core->header->dpcm_banks;
+    mmup.hugepages = core->opts.hugepages;
+    mmup.mirror = core->opts.mirror;
     if(!core_mmu_init(&core->mmu, &mmup, banks))
         return 0;
+    if(core->opts.stats_file != NULL && !core_mmu_stats_enable(core->mmu))
+        return 0;
     
     if(!core_cpu_init(&core->cpu, core->mmu))
         return 0;
@@ -151,6 +205,17 @@ int core_init(struct core_system *core, struct core_temp_banks *banks)
         return 0;
     if(!core_vpu_init(&core->vpu, core->cpu))
         return 0;
+    if(core->opts.cycle_renderer)
+        core->vpu->renderer = VPU_RENDER_CYCLE;
+    if(core->opts.indexed)
+        core->vpu->output = VPU_OUTPUT_INDEXED;
+    if(core->opts.block_fetch)
+        core->vpu->fetch = VPU_FETCH_BLOCK;
+    core->vpu->draw_every = core->opts.draw_every;
+    if(core->opts.lazy_sync)
+        core->vpu->sync = VPU_SYNC_LAZY;
+    if(core->opts.simd >= 0)
+        core->vpu->simd = core_vpu_simd_select(core->opts.simd);
     if(!core_mmu_vpu(core->mmu, core->vpu))
         return 0;
     if(!core_load_palette(core, palette))
@@ -160,7 +225,17 @@ int core_init(struct core_system *core, struct core_temp_banks *banks)
     //core_apu_init(core->apu);
     if(!core_cart_init(&core->cart, core->cpu))
        return 0;
+    if(!core_mmu_cart(core->mmu, core->cart))
+       return 0;
     //core_pad_init(core->pad);
+    if(core->opts.frames > 0 || core->opts.golden_dir != NULL) {
+        if(!core_check_init(&core->check, core->rom_fn, &core->opts,
+                    core->vpu))
+            return 0;
+        core_vpu_frame_observe(core->vpu, core_check_frame, core->check);
+    }
+    if(core->opts.render_thread && !core_vpu_thread(core->vpu))
+        return 0;
     
     LOGD("Core initialized");
     return 1;
@@ -168,72 +243,346 @@ int core_init(struct core_system *core, struct core_temp_banks *banks)
 
 int core_destroy(struct core_system *core)
 {
+    if(core->opts.stats_file != NULL)
+        core_mmu_stats_export(core->mmu, core->opts.stats_file, 1);
     core_cart_destroy(core->cart);
     core_vpu_destroy(core->vpu);
     core_mmu_destroy(core->mmu);
     core_cpu_destroy(core->cpu);
+    if(core->rom_map != NULL)
+        munmap(core->rom_map, core->rom_map_size);
+    core->rom_map = NULL;
     return 1;
 }
 
 
-/* Reads and parses the ROM from disk. */
-int core_load_rom(struct core_system *core, const char *fn,
+/*
+ * Run a debugging command on the core. The commands are:
+ *   watch <kinds> <start>[-<end>]   watch for any of r(ead), w(rite), e(x)ec
+ *   unwatch [<start>[-<end>]]       remove the watchpoints in a range, or all
+ *   stats [<file> [frame]]          count bus accesses, and write out those of
+ *                                   the session, or of the last frame
+ * Addresses are in hex, optionally prefixed with '$'.
+ */
+int core_command(struct core_system *core, const char *cmd)
+{
+    char verb[16] = "", arg1[CORE_CMD_LEN] = "", arg2[CORE_CMD_LEN] = "";
+    unsigned int start = 0x0000, end = 0xffff;
+    const char *k;
+    int n, flags = 0;
+
+    n = sscanf(cmd, "%15s %63s %63s", verb, arg1, arg2);
+    if(!strcmp(verb, "watch") && n == 3) {
+        for(k = arg1; *k != '\0'; ++k) {
+            if(*k == 'r')
+                flags |= MMU_WATCH_READ;
+            else if(*k == 'w')
+                flags |= MMU_WATCH_WRITE;
+            else if(*k == 'x')
+                flags |= MMU_WATCH_EXEC;
+            else
+                goto l_invalid;
+        }
+        if(!core_parse_range(arg2, &start, &end))
+            goto l_invalid;
+        return core_mmu_watch_add(core->mmu, start, end, flags);
+    } else if(!strcmp(verb, "unwatch") && n <= 2) {
+        if(n == 2 && !core_parse_range(arg1, &start, &end))
+            goto l_invalid;
+        core_mmu_watch_remove(core->mmu, start, end);
+        return 1;
+    } else if(!strcmp(verb, "stats")) {
+        if(n == 1)
+            return core_mmu_stats_enable(core->mmu);
+        if(n == 3 && strcmp(arg2, "frame"))
+            goto l_invalid;
+        return core_mmu_stats_export(core->mmu, arg1, n == 2);
+    }
+
+l_invalid:
+    LOGW("Invalid command '%s'", cmd);
+    return 0;
+}
+
+
+/*
+ * Queue a command for the core thread, which runs them between frames. This
+ * may be called from any thread, including before the core has started.
+ */
+int core_post_command(const char *cmd)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&cmd_lock);
+    if(cmd_num < CORE_CMD_MAX && strlen(cmd) < CORE_CMD_LEN) {
+        strcpy(cmd_queue[cmd_num++], cmd);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&cmd_lock);
+
+    if(!ok)
+        LOGW("Dropped command '%s'", cmd);
+    return ok;
+}
+
+
+/* Run the commands posted since the last call. */
+static void core_run_commands(struct core_system *core)
+{
+    char cmds[CORE_CMD_MAX][CORE_CMD_LEN];
+    int i, n;
+
+    pthread_mutex_lock(&cmd_lock);
+    n = cmd_num;
+    memcpy(cmds, cmd_queue, n * CORE_CMD_LEN);
+    cmd_num = 0;
+    pthread_mutex_unlock(&cmd_lock);
+
+    for(i = 0; i < n; ++i)
+        core_command(core, cmds[i]);
+}
+
+
+/* Parse an address range "start[-end]", in hex. */
+static int core_parse_range(const char *s, unsigned int *start,
+        unsigned int *end)
+{
+    char *e;
+
+    if(*s == '$')
+        s += 1;
+    *start = strtoul(s, &e, 16);
+    *end = *start;
+    if(e == s)
+        return 0;
+    if(*e == '-') {
+        s = e + 1;
+        if(*s == '$')
+            s += 1;
+        *end = strtoul(s, &e, 16);
+        if(e == s)
+            return 0;
+    }
+    return *e == '\0' && *start <= *end && *end <= 0xffff;
+}
+
+
+/* Parse the options following the ROM file name on the command line. */
+static void core_parse_options(struct core_options *opts, int argc,
+        char **argv)
+{
+    char cmd[CORE_CMD_LEN];
+    int i;
+
+    opts->simd = -1;
+    opts->draw_every = 1;
+    for(i = 2; i < argc; ++i) {
+        if(!strcmp(argv[i], "--hugepages")) {
+            opts->hugepages = 1;
+        } else if(!strcmp(argv[i], "--mirror")) {
+            opts->mirror = 1;
+        } else if(!strcmp(argv[i], "--cycle-renderer")) {
+            opts->cycle_renderer = 1;
+        } else if(!strcmp(argv[i], "--indexed")) {
+            opts->indexed = 1;
+        } else if(!strcmp(argv[i], "--block-fetch")) {
+            opts->block_fetch = 1;
+        } else if(!strcmp(argv[i], "--render-thread")) {
+            opts->render_thread = 1;
+        } else if(!strcmp(argv[i], "--lazy-sync")) {
+            opts->lazy_sync = 1;
+        } else if(!strcmp(argv[i], "--render-skip=all")) {
+            opts->draw_every = 0;
+        } else if(!strncmp(argv[i], "--render-skip=", 14) &&
+                atoi(argv[i] + 14) > 0) {
+            opts->draw_every = atoi(argv[i] + 14);
+        } else if(!strncmp(argv[i], "--simd=", 7)) {
+            const char *levels[] = { "none", "sse2", "ssse3", "avx2" };
+            int l;
+
+            for(l = 0; l < 4 && strcmp(argv[i] + 7, levels[l]); ++l)
+                ;
+            if(l < 4)
+                opts->simd = l;
+            else
+                LOGW("Ignoring unknown instruction set '%s'", argv[i] + 7);
+        } else if(!strncmp(argv[i], "--stats=", 8) && argv[i][8] != '\0') {
+            opts->stats_file = argv[i] + 8;
+        } else if(!strcmp(argv[i], "--headless")) {
+            opts->headless = 1;
+        } else if(!strncmp(argv[i], "--frames=", 9) &&
+                atoi(argv[i] + 9) > 0) {
+            opts->frames = atoi(argv[i] + 9);
+        } else if(!strncmp(argv[i], "--golden=", 9) && argv[i][9] != '\0') {
+            opts->golden_dir = argv[i] + 9;
+        } else if(!strncmp(argv[i], "--watch=", 8) &&
+                strchr(argv[i], ':') != NULL) {
+            /* --watch=<kinds>:<range>, run once the core is up. */
+            snprintf(cmd, sizeof(cmd), "watch %.*s %s",
+                    (int)(strchr(argv[i], ':') - argv[i] - 8), argv[i] + 8,
+                    strchr(argv[i], ':') + 1);
+            core_post_command(cmd);
+        } else {
+            LOGW("Ignoring unknown option '%s'", argv[i]);
+        }
+    }
+}
+
+
+/* Free a bank buffer, unless it points into the mapped ROM file. */
+static void core_free_temp_bank(struct core_temp_banks *banks, uint8_t *bank)
+{
+    if(bank < banks->file || bank >= banks->file + banks->file_size)
+        free(bank);
+}
+
+
+/* Free the bank buffers which had to be copied out of the ROM file. */
+static void core_free_temp_banks(struct core_temp_banks *banks)
+{
+    int i;
+
+    core_free_temp_bank(banks, banks->rom_f);
+    core_free_temp_bank(banks, banks->ram_f);
+    for(i = 0; i < 256; ++i) {
+        core_free_temp_bank(banks, banks->rom_s[i]);
+        core_free_temp_bank(banks, banks->ram_s[i]);
+        core_free_temp_bank(banks, banks->tile_s[i]);
+        core_free_temp_bank(banks, banks->dpcm_s[i]);
+    }
+    memset(banks, 0, sizeof(*banks));
+}
+
+
+/* Return the bank slot and bank size for a ROM file chunk, or NULL. */
+static uint8_t **core_rom_slot(struct core_temp_banks *banks,
+        struct core_header_bufmap *buf, size_t *size)
+{
+    switch(buf->type) {
+        case CORE_HDR_ROMF:
+            *size = MMU_ROM_BANK_SZ;
+            return &banks->rom_f;
+        case CORE_HDR_ROMS:
+            *size = MMU_ROM_BANK_SZ;
+            return &banks->rom_s[buf->num];
+        case CORE_HDR_RAMF:
+            *size = MMU_RAM_BANK_SZ;
+            return &banks->ram_f;
+        case CORE_HDR_RAMS:
+            *size = MMU_RAM_BANK_SZ;
+            return &banks->ram_s[buf->num];
+        case CORE_HDR_TILS:
+            *size = MMU_TILE_BANK_SZ;
+            return &banks->tile_s[buf->num];
+        case CORE_HDR_AUDS:
+            *size = MMU_DPCM_BANK_SZ;
+            return &banks->dpcm_s[buf->num];
+        default:
+            return NULL;
+    }
+}
+
+
+/*
+ * Maps the ROM from disk and parses it.
+ * The file is mapped read-only, and ROM banks point straight into it, so
+ * nothing is read until a bank is touched. Every other bank the guest can
+ * write, so it is copied out, as are chunks shorter than their bank, into a
+ * zero-padded buffer.
+ */
+static int core_load_rom(struct core_system *core, const char *fn,
         struct core_temp_banks *banks)
 {
     struct core_header_map *map;
     struct core_header_bufmap buf;
+    struct stat st;
     uint8_t *data;
-    int total = 0;
-    FILE *fp = NULL;
+    size_t offs, end;
+    int fd;
 
-    map = malloc(sizeof(struct core_header_map));
-    fp = fopen(fn, "rb");
-    if(fp == NULL) {
+    fd = open(fn, O_RDONLY);
+    if(fd < 0) {
         LOGE("Couldn't open ROM file '%s'", fn);
         return 0;
     }
-    if((total = fread(map, sizeof(uint8_t), 68, fp)) != 68) {
+    if(fstat(fd, &st) < 0 || st.st_size < 68) {
         LOGE("Couldn't read full ROM header");
+        close(fd);
         return 0;
     }
-    
-    do {
-        uint8_t *dst;
-        total += fread(&buf, sizeof(uint8_t), sizeof(buf), fp);
-        switch(buf.type) {
-            case CORE_HDR_ROMF:
-                banks->rom_f = malloc(buf.len);
-                dst = banks->rom_f;
-                break;
-            case CORE_HDR_ROMS:
-                banks->rom_s[buf.num] = malloc(buf.len);
-                dst = banks->rom_s[buf.num];
-                break;
-            case CORE_HDR_RAMF:
-                banks->ram_f = malloc(buf.len);
-                dst = banks->ram_f;
-                break;
-            case CORE_HDR_RAMS:
-                banks->ram_s[buf.num] = malloc(buf.len);
-                dst = banks->ram_s[buf.num];
-                break;
-            case CORE_HDR_TILS:
-                banks->tile_s[buf.num] = malloc(buf.len);
-                dst = banks->tile_s[buf.num];
-                break;
-            case CORE_HDR_AUDS:
-                banks->dpcm_s[buf.num] = malloc(buf.len);
-                dst = banks->dpcm_s[buf.num];
-                break;
-            default:
-                LOGE("Invalid buffer type found 0x%02x", buf.type);
-                return 0;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        LOGE("Couldn't map ROM file '%s'", fn);
+        return 0;
+    }
+
+    map = malloc(sizeof(struct core_header_map));
+    if(map == NULL) {
+        LOGE("Could not allocate ROM header");
+        munmap(data, st.st_size);
+        return 0;
+    }
+    memcpy(map, data, 68);
+    map->data = data;
+    if(map->size < 68 || map->size > (size_t)st.st_size) {
+        LOGE("Invalid ROM size %u in header, for a file of %zu bytes",
+             map->size, (size_t)st.st_size);
+        munmap(data, st.st_size);
+        free(map);
+        return 0;
+    }
+    end = map->size;
+
+    /*
+     * Check every chunk lies within the file, and fills a bank no other chunk
+     * has, before using any of them; meanwhile, point the banks at their
+     * chunks in the file.
+     */
+    banks->file = data;
+    banks->file_size = st.st_size;
+    for(offs = 68; offs < end; offs += sizeof(buf) + buf.len) {
+        uint8_t **slot;
+        size_t size;
+        if(offs + sizeof(buf) > end) {
+            LOGE("Truncated buffer header at offset %zu", offs);
+            goto l_invalid;
+        }
+        memcpy(&buf, data + offs, sizeof(buf));
+        slot = core_rom_slot(banks, &buf, &size);
+        if(slot == NULL) {
+            LOGE("Invalid buffer type found 0x%02x", buf.type);
+            goto l_invalid;
+        }
+        /* Banks are sized by the MMU; the chunk must fit in one. */
+        if(buf.len > size || offs + sizeof(buf) + buf.len > end) {
+            LOGE("Invalid buffer of %d bytes for type 0x%02x",
+                 buf.len, buf.type);
+            goto l_invalid;
         }
-        total += fread(dst, sizeof(uint8_t), buf.len, fp);
+        if(*slot != NULL) {
+            LOGE("Duplicate buffer for type 0x%02x", buf.type);
+            goto l_invalid;
+        }
+        *slot = data + offs + sizeof(buf);
+    }
 
-    } while(total < map->size);
-    
-    fclose(fp);
+    /* Now copy out the banks which cannot stay in the file. */
+    for(offs = 68; offs < end; offs += sizeof(buf) + buf.len) {
+        uint8_t **slot;
+        size_t size = 0;
+        memcpy(&buf, data + offs, sizeof(buf));
+        slot = core_rom_slot(banks, &buf, &size);
+        if(buf.len == size && (buf.type == CORE_HDR_ROMF ||
+                    buf.type == CORE_HDR_ROMS))
+            continue;
+        *slot = calloc(1, size);
+        if(*slot == NULL) {
+            LOGE("Could not allocate bank for type 0x%02x", buf.type);
+            goto l_invalid;
+        }
+        memcpy(*slot, data + offs + sizeof(buf), buf.len);
+    }
 
     LOGD("Header: size: %d, rom banks: %d, ram banks: %d, tile banks: %d, "
          "dpcm banks: %d",
@@ -242,13 +591,22 @@ int core_load_rom(struct core_system *core, const char *fn,
     LOGD("Header: name: '%s', description: '%s'", map->name, map->desc);
 
     core->header = map;
+    core->rom_fn = fn;
+    core->rom_map = data;
+    core->rom_map_size = st.st_size;
 
     return 1;
+
+l_invalid:
+    core_free_temp_banks(banks);
+    munmap(data, st.st_size);
+    free(map);
+    return 0;
 }
 
 
 /* Read the palette into memory for the VPU. */
-int core_load_palette(struct core_system *core, uint8_t *buffer)
+static int core_load_palette(struct core_system *core, uint8_t *buffer)
 {
     int n;
     FILE *fp = NULL;
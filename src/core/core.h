@@ -9,10 +9,15 @@
 #ifndef QPRA_CORE_H
 #define QPRA_CORE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define CORE_CYCLES_S               5360520
 
+/* Commands which can be queued for the core thread at once, and their size. */
+#define CORE_CMD_MAX                16
+#define CORE_CMD_LEN                64
+
 #ifdef _DEBUG
 #define CORE_CYCLES_F               20
 #define CORE_CYCLES_VBLANK          10
@@ -56,6 +61,11 @@ struct core_header_bufmap
 };
 #pragma pack(pop)
 
+/*
+ * The banks provided by the ROM file, each holding a full bank's worth of
+ * data. Banks lying within [file, file + file_size) point into the mapped ROM
+ * file; any others are heap copies owned by this structure.
+ */
 struct core_temp_banks
 {
     uint8_t *rom_f;
@@ -64,6 +74,40 @@ struct core_temp_banks
     uint8_t *ram_s[256];
     uint8_t *tile_s[256];
     uint8_t *dpcm_s[256];
+
+    uint8_t *file;
+    size_t file_size;
+};
+
+/* Options given on the command line, after the ROM file name. */
+struct core_options
+{
+    /* Back emulated memory with transparent huge pages. */
+    int hugepages;
+    /* Mirror the address space in host memory. */
+    int mirror;
+    /* Render pixel by pixel, for ROMs relying on raster effects. */
+    int cycle_renderer;
+    /* Write fixed palette indices instead of RGBA to the framebuffer. */
+    int indexed;
+    /* Read each line's tile data at once, not interleaved with the CPU. */
+    int block_fetch;
+    /* Draw one frame in this many, or none if 0. */
+    int draw_every;
+    /* Draw the frames on a thread of their own. */
+    int render_thread;
+    /* Let the VPU fall behind the CPU, catching up only when it could tell. */
+    int lazy_sync;
+    /* Highest instruction set for the pixel kernels, or -1 for the best. */
+    int simd;
+    /* Count bus accesses, and write them out to this file on exit. */
+    const char *stats_file;
+    /* Run without the UI, as fast as possible. */
+    int headless;
+    /* Stop after this many frames, or 0 to run on. */
+    int frames;
+    /* Check each frame against the golden images in this directory. */
+    const char *golden_dir;
 };
 
 struct core_system
@@ -76,13 +120,20 @@ struct core_system
     struct core_pad *pad;
 
     struct core_header_map *header;
+    struct core_options opts;
+    /* The ROM file loaded, and the checks on its frames, if any. */
+    const char *rom_fn;
+    struct core_check *check;
+
+    /* Read-only mapping of the ROM file, which ROM banks may point into. */
+    uint8_t *rom_map;
+    size_t rom_map_size;
 };
 
 void *core_entry(void *);
 int core_init(struct core_system *, struct core_temp_banks *);
 int core_destroy(struct core_system *core);
-static int core_load_rom(struct core_system *, const char *,
-        struct core_temp_banks *);
-static int core_load_palette(struct core_system *, uint8_t *);
+int core_command(struct core_system *, const char *);
+int core_post_command(const char *);
 
 #endif
@@ -57,7 +57,7 @@ int core_cpu_init(struct core_cpu **pcpu, struct core_mmu *mmu)
     struct core_cpu *cpu;
     
     *pcpu = NULL;
-    *pcpu = malloc(sizeof(struct core_cpu));
+    *pcpu = calloc(1, sizeof(struct core_cpu));
     if(*pcpu == NULL) {
         LOGE("Could not allocate cpu core; exiting");
         return 0;
@@ -193,7 +193,7 @@ void core_cpu_i_cycle(struct core_cpu *cpu)
         cpu->i_middle = 1;
         memset(&p, 0, sizeof(p));
 
-        core_mmu_rw_send_cpu(cpu->mmu, cpu->r[R_P]);
+        core_mmu_fw_send_cpu(cpu->mmu, cpu->r[R_P]);
         cpu->r[R_P] += 2;
 
         p.p = cpu->r[R_P];
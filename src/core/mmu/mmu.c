@@ -5,8 +5,11 @@
  *
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "core/core.h"
 #include "core/mmu/mmu.h"
@@ -16,124 +19,177 @@
 #include "core/cart/cart.h"
 #include "log.h"
 
-/* Static memory banks. */
-static uint8_t *rom_f;
-static uint8_t **rom_s;
-static uint8_t *ram_f;
-static uint8_t **ram_s;
-static uint8_t **tile_s;
-static uint8_t **dpcm_s;
-static uint8_t *fixed0_f;
-static uint8_t *fixed1_f;
-
 /* Private functions. */
 static uint8_t core_mmu_readb(struct core_mmu *, uint16_t);
 static void core_mmu_writeb(struct core_mmu *, uint16_t, uint8_t);
 static uint16_t core_mmu_readw(struct core_mmu *, uint16_t);
 static void core_mmu_writew(struct core_mmu *, uint16_t, uint16_t);
+static uint8_t core_mmu__io_readb(struct core_mmu *, uint16_t);
+static void core_mmu__io_writeb(struct core_mmu *, uint16_t, uint8_t);
+static uint8_t core_mmu__watch_readb(struct core_mmu *, uint16_t);
+static void core_mmu__watch_writeb(struct core_mmu *, uint16_t, uint8_t);
+static void core_mmu__watch_check(struct core_mmu *, uint16_t, int, uint8_t);
+static void core_mmu__watch_pages(struct core_mmu *);
+static void core_mmu__stats_count(struct core_mmu *);
+static const char *core_mmu__region(unsigned int);
+static size_t core_mmu__arena_carve(struct core_mmu_arena *, size_t);
+static int core_mmu__arena_alloc(struct core_mmu_arena *, int, int);
+static int core_mmu__mirror_init(struct core_mmu *);
+static void core_mmu__mirror_map(struct core_mmu *, uint16_t, uint16_t,
+        size_t);
+static void core_mmu__mirror_limit(struct core_mmu *);
+static void core_mmu__arena_free(struct core_mmu_arena *);
+static uint8_t *core_mmu__bank_init(struct core_mmu *, uint8_t **,
+        uint8_t *, size_t);
+static uint8_t *core_mmu__bank(struct core_mmu *, enum core_mmu_bank, uint8_t,
+        size_t *);
+static void core_mmu__map_pages(struct core_mmu *, uint16_t, uint16_t,
+        uint8_t *, size_t);
+static void core_mmu__dirty_fold(struct core_mmu *, size_t, size_t);
+static uint8_t core_mmu__bank_readb(void *, uint16_t);
+static void core_mmu__bank_writeb(void *, uint16_t, uint8_t);
+static uint8_t core_mmu__intvec_readb(void *, uint16_t);
+static void core_mmu__intvec_writeb(void *, uint16_t, uint8_t);
+static uint8_t core_mmu__hrc_readb(void *, uint16_t);
+static void core_mmu__hrc_writeb(void *, uint16_t, uint8_t);
+static uint8_t core_mmu__vpu_readb(void *, uint16_t);
+static void core_mmu__vpu_writeb(void *, uint16_t, uint8_t);
+static uint8_t core_mmu__cart_readb(void *, uint16_t);
+static void core_mmu__cart_writeb(void *, uint16_t, uint8_t);
 
 /*
  * Initialize the MMU.
- * Allocates memory for the core_mmu structure, and for each of the memory
- * buffers it owns.
+ * Allocates memory for the core_mmu structure, and a single arena from which
+ * every memory bank it owns is carved. Banks supplied by the ROM file are used
+ * in place where they are mapped from it, and copied in otherwise.
  * Sets up callbacks for I/O which redirects to another system component.
  */
 int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
         struct core_temp_banks *banks)
 {
-    int i;
     struct core_mmu *mmu;
+    struct core_mmu_arena *ar;
+    size_t rom_s, ram_s, tile_s, dpcm_s;
    
     /* First, allocate the MMU structure. */
     *pmmu = NULL;
-    *pmmu = malloc(sizeof(struct core_mmu));
+    *pmmu = calloc(1, sizeof(struct core_mmu));
     if(*pmmu == NULL) {
         LOGE("Could not allocate mmu core; exiting");
         return 0;
     }
     mmu = *pmmu;
-    
-    /* Allocate the two fixed banks. */
-    rom_f = banks->rom_f; 
-    mmu->rom_f = rom_f;
+    ar = &mmu->arena;
 
-    ram_f = banks->ram_f ? banks->ram_f : calloc(8*1024, sizeof(uint8_t));
-    mmu->ram_f = ram_f;
+    /* Slot 0 has no handlers, and catches every address no device claims. */
+    mmu->io[0].start = 0x0000;
+    mmu->io[0].end = 0xffff;
+    mmu->io_num = 1;
 
-    /* Allocate the two banks for misc. use at address space end. */
-    fixed0_f = calloc(6*256, sizeof(uint8_t));
-    fixed1_f = calloc(256, sizeof(uint8_t));
-    if(fixed0_f == NULL || fixed1_f == NULL)
-        goto l_malloc_error;
-    mmu->fixed0_f = fixed0_f;
-    mmu->fixed1_f = fixed1_f;
-
-    /* Clear the interrupt vector. */
-    memset(mmu->intvec, 0, sizeof(mmu->intvec));
-
-    /* Allocate the switchable ROM banks. */
     if(params->rom_banks == 0) {
         LOGE("Requested 0 swappabled ROM banks; minimum is 1");
         return 0;
     }
-    mmu->rom_s_total = params->rom_banks;
-    rom_s = calloc(params->rom_banks, sizeof(uint8_t *));
-    if(rom_s == NULL)
-        goto l_malloc_error;
-    for(i = 0; i < params->rom_banks; ++i) {
-        rom_s[i] = banks->rom_s[i] ?
-            banks->ram_f :
-            calloc(8*1024, sizeof(uint8_t)); 
-    }
-    mmu->rom_s = rom_s[0]; 
-
-    /* Allocate the switchable RAM banks. */
     if(params->ram_banks == 0) {
         LOGE("Requested 0 swappable RAM banks; minimum is 1");
         return 0;
     }
-    mmu->ram_s_total = params->ram_banks;
-    ram_s = calloc(params->ram_banks, sizeof(uint8_t *));
-    if(ram_s == NULL)
-        goto l_malloc_error;
-    for(i = 0; i < params->ram_banks; ++i) {
-        ram_s[i] = banks->ram_s[i] ?
-            banks->ram_s[i] :
-            calloc(8*1024, sizeof(uint8_t)); 
-    }
-    mmu->ram_s = ram_s[0];
-
-    /* Allocate the switchable tile ROM banks. */
     if(params->tile_banks == 0) {
         LOGE("Requested 0 tile banks; minimum is 1");
         return 0;
     }
-    mmu->tile_s_total = params->tile_banks;
-    tile_s = calloc(params->tile_banks, sizeof(uint8_t *));
-    if(tile_s == NULL)
-        goto l_malloc_error;
-    for(i = 0; i < params->tile_banks; ++i) {
-        tile_s[i] = banks->tile_s[i] ?
-            banks->tile_s[i] :
-            calloc(8*1024, sizeof(uint8_t)); 
-    }
-    mmu->tile_s = tile_s[0];
-
-    /* Allocate the switchable DPCM ROM banks. */
     if(params->dpcm_banks == 0) {
         LOGE("Requested 0 DPCM banks; minimum is 1");
         return 0;
     }
+    mmu->rom_s_total = params->rom_banks;
+    mmu->ram_s_total = params->ram_banks;
+    mmu->tile_s_total = params->tile_banks;
     mmu->dpcm_s_total = params->dpcm_banks;
-    dpcm_s = calloc(params->dpcm_banks, sizeof(uint8_t *));
-    if(dpcm_s == NULL)
+
+    /*
+     * Lay out every bank in the arena, then allocate it in one go. For the
+     * mirror, banks must start on host pages so they can be mapped again.
+     */
+    ar->size = 0;
+    ar->align = params->mirror ? MMU_MIRROR_ALIGN : MMU_ARENA_ALIGN;
+    ar->fd = -1;
+    ar->rom_f = core_mmu__arena_carve(ar, MMU_ROM_BANK_SZ);
+    ar->rom_s = core_mmu__arena_carve(ar, params->rom_banks * MMU_ROM_BANK_SZ);
+    ar->ram_f = core_mmu__arena_carve(ar, MMU_RAM_BANK_SZ);
+    ar->ram_s = core_mmu__arena_carve(ar, params->ram_banks * MMU_RAM_BANK_SZ);
+    ar->tile_s = core_mmu__arena_carve(ar,
+            params->tile_banks * MMU_TILE_BANK_SZ);
+    ar->dpcm_s = core_mmu__arena_carve(ar,
+            params->dpcm_banks * MMU_DPCM_BANK_SZ);
+    ar->fixed0_f = core_mmu__arena_carve(ar, MMU_FIXED0_SZ);
+    ar->fixed1_f = core_mmu__arena_carve(ar, MMU_FIXED1_SZ);
+    ar->vpu_mem = core_mmu__arena_carve(ar, MMU_VPU_MEM_SZ);
+    ar->vpu_fb = core_mmu__arena_carve(ar, MMU_VPU_FB_SZ * MMU_VPU_FB_NUM);
+    if(!core_mmu__arena_alloc(ar, params->hugepages, params->mirror))
         goto l_malloc_error;
-    for(i = 0; i < params->dpcm_banks; ++i) {
-        dpcm_s[i] = banks->dpcm_s[i] ?
-            banks->dpcm_s :
-            calloc(2*1024, sizeof(uint8_t)); 
-    }
-    mmu->dpcm_s = dpcm_s[0];
+    if(params->mirror && !core_mmu__mirror_init(mmu))
+        LOGW("core.mmu: continuing without the address space mirror");
+
+    /* One dirty bit and generation stamp for each page of the arena. */
+    mmu->dirty_pages = (ar->size + MMU_PAGE_SZ - 1) >> MMU_PAGE_SHIFT;
+    mmu->dirty = calloc((mmu->dirty_pages + 63) / 64, sizeof(uint64_t));
+    mmu->dirty_gen = calloc(mmu->dirty_pages, sizeof(uint32_t));
+    if(mmu->dirty == NULL || mmu->dirty_gen == NULL)
+        goto l_malloc_error;
+
+    /*
+     * Take over the banks from the ROM file. Switchable banks are only set up
+     * when first selected, so keep hold of their sources until then.
+     */
+    mmu->src = malloc(sizeof(struct core_temp_banks));
+    if(mmu->src == NULL)
+        goto l_malloc_error;
+    *mmu->src = *banks;
+    memset(banks, 0, sizeof(*banks));
+
+    /* The two fixed banks. */
+    mmu->rom_f = core_mmu__bank_init(mmu, &mmu->src->rom_f,
+            ar->base + ar->rom_f, MMU_ROM_BANK_SZ);
+    mmu->ram_f = core_mmu__bank_init(mmu, &mmu->src->ram_f,
+            ar->base + ar->ram_f, MMU_RAM_BANK_SZ);
+
+    /* The two banks for misc. use at address space end. */
+    mmu->fixed0_f = ar->base + ar->fixed0_f;
+    mmu->fixed1_f = ar->base + ar->fixed1_f;
+
+    /* Clear the interrupt vector. */
+    memset(mmu->intvec, 0, sizeof(mmu->intvec));
+
+    /* Only bank 0 of each switchable kind is needed to begin with. */
+    mmu->rom_s = core_mmu__bank(mmu, B_ROM_SWAP, 0, &rom_s);
+    mmu->ram_s = core_mmu__bank(mmu, B_RAM_SWAP, 0, &ram_s);
+    mmu->tile_s = core_mmu__bank(mmu, B_TILE_SWAP, 0, &tile_s);
+    mmu->dpcm_s = core_mmu__bank(mmu, B_DPCM_SWAP, 0, &dpcm_s);
+
+    /* Point the page table at the plain memory regions. */
+    core_mmu__map_pages(mmu, A_ROM_FIXED, A_ROM_FIXED_END, mmu->rom_f,
+            ar->rom_f);
+    core_mmu__map_pages(mmu, A_ROM_SWAP, A_ROM_SWAP_END, mmu->rom_s, rom_s);
+    core_mmu__map_pages(mmu, A_RAM_FIXED, A_RAM_FIXED_END, mmu->ram_f,
+            ar->ram_f);
+    core_mmu__map_pages(mmu, A_RAM_SWAP, A_RAM_SWAP_END, mmu->ram_s, ram_s);
+    core_mmu__map_pages(mmu, A_TILE_SWAP, A_TILE_SWAP_END, mmu->tile_s,
+            tile_s);
+    core_mmu__map_pages(mmu, A_DPCM_SWAP, A_DPCM_SWAP_END, mmu->dpcm_s,
+            dpcm_s);
+    core_mmu__mirror_limit(mmu);
+
+    /* The MMU's own registers. These sit inside the VPU and APU ranges, so
+     * they are registered first to take precedence over them. */
+    core_mmu_map_io(mmu, A_TILE_BANK_SELECT, A_TILE_BANK_SELECT,
+            core_mmu__bank_readb, core_mmu__bank_writeb, mmu);
+    core_mmu_map_io(mmu, A_DPCM_BANK_SELECT, A_DPCM_BANK_SELECT,
+            core_mmu__bank_readb, core_mmu__bank_writeb, mmu);
+    core_mmu_map_io(mmu, A_ROM_BANK_SELECT, A_RAM_BANK_SELECT,
+            core_mmu__bank_readb, core_mmu__bank_writeb, mmu);
+    core_mmu_map_io(mmu, A_INT_VEC, A_INT_VEC_END,
+            core_mmu__intvec_readb, core_mmu__intvec_writeb, mmu);
    
     /* Everything was allocated properly, phew. */
     LOGD("Allocated: %hhu ROM bank%s, %hhu RAM bank%s, %hhu tile ROM bank%s,"
@@ -142,6 +198,9 @@ int core_mmu_init(struct core_mmu **pmmu, struct core_mmu_params *params,
          params->ram_banks, params->ram_banks > 1 ? "s" : "",
          params->tile_banks, params->tile_banks > 1 ? "s" : "",
          params->dpcm_banks, params->dpcm_banks > 1 ? "s" : "");
+    LOGD("Arena: %zu bytes%s%s", ar->size,
+         ar->hugepages ? " (transparent huge pages)" : "",
+         mmu->mirror != NULL ? " (mirrored)" : "");
 
     return 1;
 
@@ -165,7 +224,8 @@ int core_mmu_cpu(struct core_mmu *mmu, struct core_cpu *cpu)
     }
 
     mmu->cpu = cpu;
-    return 1;
+    return core_mmu_map_io(mmu, A_HIRES_CTR, A_HIRES_CTR + 1,
+            core_mmu__hrc_readb, core_mmu__hrc_writeb, cpu);
 }
 
 /* Similar rationale to the above, except for the VPU state. */
@@ -177,7 +237,8 @@ int core_mmu_vpu(struct core_mmu *mmu, struct core_vpu *vpu)
     }
 
     mmu->vpu = vpu;
-    return 1;
+    return core_mmu_map_io(mmu, A_VPU_START, A_VPU_END,
+            core_mmu__vpu_readb, core_mmu__vpu_writeb, vpu);
 }
 
 /* Similar rationale to the above, except for the cart state. */
@@ -189,46 +250,37 @@ int core_mmu_cart(struct core_mmu *mmu, struct core_cart *cart)
    }
 
    mmu->cart = cart;
-   return 1;
+   return core_mmu_map_io(mmu, A_CART_FIXED, A_CART_FIXED_END,
+           core_mmu__cart_readb, core_mmu__cart_writeb, cart);
 }
 
 /* 
  * Destroy the MMU state.
- * Frees all the memory buffers it owns.
+ * Frees the arena holding all the memory banks.
  */
 int core_mmu_destroy(struct core_mmu *mmu)
 {
     int i;
 
-    free(rom_f);
-    mmu->rom_f = rom_f = NULL;
-    free(ram_f);
-    mmu->ram_f = ram_f = NULL;
-    free(fixed0_f);
-    mmu->fixed0_f = fixed0_f = NULL;
-    free(fixed1_f);
-    mmu->fixed1_f = fixed1_f = NULL;
-
-    for(i = 0; i < mmu->rom_s_total; ++i)
-        free(rom_s[i]);
-    free(rom_s);
-    mmu->rom_s = NULL, rom_s = NULL;
-    
-    for(i = 0; i < mmu->ram_s_total; ++i)
-        free(ram_s[i]);
-    free(ram_s);
-    mmu->ram_s = NULL, ram_s = NULL;
-    
-    for(i = 0; i < mmu->tile_s_total; ++i)
-        free(tile_s[i]);
-    free(tile_s);
-    mmu->tile_s = NULL, tile_s = NULL;
-
-    for(i = 0; i < mmu->dpcm_s_total; ++i)
-        free(dpcm_s[i]);
-    free(dpcm_s);
-    mmu->dpcm_s = NULL, dpcm_s = NULL;
-    
+    LOGD("core.mmu: %d of %d switchable banks were touched",
+         mmu->banks_touched, mmu->rom_s_total + mmu->ram_s_total +
+         mmu->tile_s_total + mmu->dpcm_s_total);
+
+    /* Drop the sources of any banks which were never selected. */
+    for(i = 0; i < 256; ++i) {
+        core_mmu__bank_init(mmu, &mmu->src->rom_s[i], NULL, 0);
+        core_mmu__bank_init(mmu, &mmu->src->ram_s[i], NULL, 0);
+        core_mmu__bank_init(mmu, &mmu->src->tile_s[i], NULL, 0);
+        core_mmu__bank_init(mmu, &mmu->src->dpcm_s[i], NULL, 0);
+    }
+    free(mmu->src);
+
+    free(mmu->dirty);
+    free(mmu->dirty_gen);
+    free(mmu->stats);
+    if(mmu->mirror != NULL)
+        munmap(mmu->mirror, 0x10000);
+    core_mmu__arena_free(&mmu->arena);
     free(mmu);
 
     return 1;
@@ -238,33 +290,362 @@ int core_mmu_destroy(struct core_mmu *mmu)
 /* 
  * Select the bank index for a specific memory bank.
  * Causes the correct bank to be switched in, and the previous one switched
- * out.
+ * out. A bank is set up the first time it is selected.
  */
 int core_mmu_bank_select(struct core_mmu *mmu, enum core_mmu_bank bank,
                          uint8_t index)
 {
+    int total[] = {
+        mmu->rom_s_total, mmu->ram_s_total, mmu->tile_s_total,
+        mmu->dpcm_s_total
+    };
+    size_t slot;
+    uint8_t *mem = NULL;
+    int i;
+
+    if(index >= total[bank]) {
+        LOGW("core.mmu: bank %d selected, but only %d present", index,
+             total[bank]);
+        return 0;
+    }
+
     switch(bank) {
         case B_ROM_SWAP:
             mmu->rom_s_bank = index;
-            mmu->rom_s = rom_s[index];
+            mmu->rom_s = mem = core_mmu__bank(mmu, bank, index, &slot);
+            core_mmu__map_pages(mmu, A_ROM_SWAP, A_ROM_SWAP_END, mem, slot);
             break;
         case B_RAM_SWAP:
             mmu->ram_s_bank = index;
-            mmu->ram_s = ram_s[index];
+            mmu->ram_s = mem = core_mmu__bank(mmu, bank, index, &slot);
+            core_mmu__map_pages(mmu, A_RAM_SWAP, A_RAM_SWAP_END, mem, slot);
             break;
         case B_TILE_SWAP:
             mmu->tile_bank = index;
-            mmu->tile_s = tile_s[index];
+            mmu->tile_s = mem = core_mmu__bank(mmu, bank, index, &slot);
+            core_mmu__map_pages(mmu, A_TILE_SWAP, A_TILE_SWAP_END, mem, slot);
             break;
         case B_DPCM_SWAP:
             mmu->dpcm_bank = index;
-            mmu->dpcm_s = dpcm_s[index];
+            mmu->dpcm_s = mem = core_mmu__bank(mmu, bank, index, &slot);
+            core_mmu__map_pages(mmu, A_DPCM_SWAP, A_DPCM_SWAP_END, mem, slot);
             break;
     }
+
+    for(i = 0; i < mmu->observer_num; ++i)
+        mmu->observers[i].fn(mmu->observers[i].ctx, bank, index, mem);
+    return 1;
+}
+
+
+/* Add a function to call on every bank switch. */
+int core_mmu_bank_observe(struct core_mmu *mmu, core_mmu_bank_fn fn, void *ctx)
+{
+    if(mmu->observer_num == MMU_OBSERVER_MAX) {
+        LOGE("No free bank switch observer slot");
+        return 0;
+    }
+
+    mmu->observers[mmu->observer_num].fn = fn;
+    mmu->observers[mmu->observer_num].ctx = ctx;
+    mmu->observer_num += 1;
+    return 1;
+}
+
+
+/* Stop calling a function added with core_mmu_bank_observe; return if it was. */
+int core_mmu_bank_unobserve(struct core_mmu *mmu, core_mmu_bank_fn fn,
+        void *ctx)
+{
+    int i;
+
+    for(i = 0; i < mmu->observer_num; ++i) {
+        if(mmu->observers[i].fn == fn && mmu->observers[i].ctx == ctx) {
+            mmu->observer_num -= 1;
+            memmove(&mmu->observers[i], &mmu->observers[i + 1],
+                    (mmu->observer_num - i) * sizeof(mmu->observers[0]));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Register a device's handlers for an I/O range. */
+int core_mmu_map_io(struct core_mmu *mmu, uint16_t start, uint16_t end,
+        core_mmu_io_readb readb, core_mmu_io_writeb writeb, void *ctx)
+{
+    struct core_mmu_io *io;
+    unsigned int a;
+
+    if(start > end) {
+        LOGE("Invalid I/O range $%04x-$%04x", start, end);
+        return 0;
+    }
+    if(mmu->io_num == MMU_IO_MAX) {
+        LOGE("No free I/O slot for range $%04x-$%04x", start, end);
+        return 0;
+    }
+
+    io = &mmu->io[mmu->io_num];
+    io->start = start;
+    io->end = end;
+    io->readb = readb;
+    io->writeb = writeb;
+    io->ctx = ctx;
+
+    for(a = start; a <= end; ++a) {
+        if(mmu->io_map[a] == 0)
+            mmu->io_map[a] = mmu->io_num;
+        mmu->page[a >> MMU_PAGE_SHIFT] = NULL;
+        mmu->page_mem[a >> MMU_PAGE_SHIFT] = NULL;
+    }
+    mmu->io_num += 1;
+    core_mmu__mirror_limit(mmu);
+
+    LOGD("core.mmu: mapped I/O range $%04x-$%04x", start, end);
+    return 1;
+}
+
+
+/* Add a watchpoint for a range of addresses. */
+int core_mmu_watch_add(struct core_mmu *mmu, uint16_t start, uint16_t end,
+        int flags)
+{
+    struct core_mmu_watch *w;
+
+    flags &= MMU_WATCH_READ | MMU_WATCH_WRITE | MMU_WATCH_EXEC;
+    if(start > end || flags == 0) {
+        LOGE("Invalid watchpoint $%04x-$%04x", start, end);
+        return 0;
+    }
+    if(mmu->watch_num == MMU_WATCH_MAX) {
+        LOGE("No free watchpoint for $%04x-$%04x", start, end);
+        return 0;
+    }
+
+    w = &mmu->watch[mmu->watch_num++];
+    w->start = start;
+    w->end = end;
+    w->flags = flags;
+    core_mmu__watch_pages(mmu);
+
+    LOGD("core.mmu: watching $%04x-$%04x (%s%s%s)", start, end,
+         flags & MMU_WATCH_READ ? "r" : "", flags & MMU_WATCH_WRITE ? "w" : "",
+         flags & MMU_WATCH_EXEC ? "x" : "");
     return 1;
 }
 
 
+/* Remove all the watchpoints inside a range of addresses. */
+int core_mmu_watch_remove(struct core_mmu *mmu, uint16_t start, uint16_t end)
+{
+    int i, n = 0;
+
+    for(i = 0; i < mmu->watch_num; ++i) {
+        if(mmu->watch[i].start >= start && mmu->watch[i].end <= end)
+            n += 1;
+        else
+            mmu->watch[i - n] = mmu->watch[i];
+    }
+    mmu->watch_num -= n;
+    core_mmu__watch_pages(mmu);
+
+    LOGD("core.mmu: removed %d watchpoint%s", n, n == 1 ? "" : "s");
+    return n;
+}
+
+
+/* Set the function called when a watchpoint triggers. */
+void core_mmu_watch_callback(struct core_mmu *mmu, core_mmu_watch_hit fn,
+        void *ctx)
+{
+    mmu->watch_fn = fn;
+    mmu->watch_ctx = ctx;
+}
+
+
+/* Set or remove the write hook. */
+int core_mmu_write_hook(struct core_mmu *mmu, uint16_t start, uint16_t end,
+        core_mmu_write_fn fn, void *ctx)
+{
+    if(start > end) {
+        LOGE("Invalid write hook range $%04x-$%04x", start, end);
+        return 0;
+    }
+
+    mmu->hook_fn = fn;
+    mmu->hook_ctx = ctx;
+    mmu->hook_start = start;
+    mmu->hook_end = end;
+    core_mmu__watch_pages(mmu);
+    return 1;
+}
+
+
+/* Start counting bus accesses. */
+int core_mmu_stats_enable(struct core_mmu *mmu)
+{
+    if(mmu->stats != NULL)
+        return 1;
+
+    mmu->stats = calloc(1, sizeof(struct core_mmu_stats));
+    if(mmu->stats == NULL) {
+        LOGE("Could not allocate bus statistics");
+        return 0;
+    }
+    LOGD("core.mmu: counting bus accesses");
+    return 1;
+}
+
+
+/* Close the frame's bus access counts. */
+void core_mmu_stats_frame(struct core_mmu *mmu)
+{
+    struct core_mmu_stats *st = mmu->stats;
+    int r, k, i;
+
+    if(st == NULL)
+        return;
+
+    for(r = 0; r < 2; ++r)
+        for(k = 0; k < 2; ++k)
+            for(i = 0; i < MMU_NUM_PAGES; ++i)
+                st->session[r][k][i] += st->frame[r][k][i];
+    memcpy(st->last, st->frame, sizeof(st->last));
+    memset(st->frame, 0, sizeof(st->frame));
+    st->frames += 1;
+}
+
+
+/*
+ * Write out the bus access counts of the session so far, or of the last frame.
+ * The CSV has one row per page, then one per region. The binary dump is the
+ * magic "QPST", the number of frames as a 32-bit integer, and the counts as
+ * 64-bit integers in the layout of struct core_mmu_stats, in host byte order.
+ */
+int core_mmu_stats_export(struct core_mmu *mmu, const char *fn, int session)
+{
+    struct core_mmu_stats *st = mmu->stats;
+    uint64_t (*c)[2][MMU_NUM_PAGES];
+    uint64_t region[4];
+    size_t len = strlen(fn);
+    unsigned int i, j, first;
+    FILE *f;
+
+    if(st == NULL) {
+        LOGW("core.mmu: bus statistics are not enabled");
+        return 0;
+    }
+    f = fopen(fn, "wb");
+    if(f == NULL) {
+        LOGE("Could not open '%s' for writing", fn);
+        return 0;
+    }
+    c = session ? st->session : st->last;
+
+    if(len >= 4 && !strcmp(fn + len - 4, ".csv")) {
+        fprintf(f, "start,end,region,cpu_reads,cpu_writes,vpu_reads,"
+                "vpu_writes\n");
+        for(i = 0; i < MMU_NUM_PAGES; ++i) {
+            fprintf(f, "%04x,%04x,%s,%llu,%llu,%llu,%llu\n",
+                    i << MMU_PAGE_SHIFT, ((i + 1) << MMU_PAGE_SHIFT) - 1,
+                    core_mmu__region(i),
+                    (unsigned long long)c[MMU_STATS_CPU][MMU_STATS_READ][i],
+                    (unsigned long long)c[MMU_STATS_CPU][MMU_STATS_WRITE][i],
+                    (unsigned long long)c[MMU_STATS_VPU][MMU_STATS_READ][i],
+                    (unsigned long long)c[MMU_STATS_VPU][MMU_STATS_WRITE][i]);
+        }
+        /* Regions are runs of pages; the misc. region is in two parts. */
+        for(i = 0; i < MMU_NUM_PAGES; i = j) {
+            first = i;
+            memset(region, 0, sizeof(region));
+            for(j = i; j < MMU_NUM_PAGES &&
+                    core_mmu__region(j) == core_mmu__region(i); ++j) {
+                region[0] += c[MMU_STATS_CPU][MMU_STATS_READ][j];
+                region[1] += c[MMU_STATS_CPU][MMU_STATS_WRITE][j];
+                region[2] += c[MMU_STATS_VPU][MMU_STATS_READ][j];
+                region[3] += c[MMU_STATS_VPU][MMU_STATS_WRITE][j];
+            }
+            fprintf(f, "%04x,%04x,%s,%llu,%llu,%llu,%llu\n",
+                    first << MMU_PAGE_SHIFT, (j << MMU_PAGE_SHIFT) - 1,
+                    core_mmu__region(first),
+                    (unsigned long long)region[0],
+                    (unsigned long long)region[1],
+                    (unsigned long long)region[2],
+                    (unsigned long long)region[3]);
+        }
+    } else {
+        uint32_t frames = session ? st->frames : 1;
+
+        fwrite("QPST", 1, 4, f);
+        fwrite(&frames, sizeof(frames), 1, f);
+        fwrite(c, sizeof(st->last), 1, f);
+    }
+
+    if(fclose(f) != 0) {
+        LOGE("Could not write bus statistics to '%s'", fn);
+        return 0;
+    }
+    LOGD("core.mmu: wrote %s bus statistics to '%s'",
+         session ? "session" : "frame", fn);
+    return 1;
+}
+
+
+/* Start tracking writes to a range of the arena. */
+int core_mmu_dirty_register(struct core_mmu *mmu, size_t offs, size_t size)
+{
+    struct core_mmu_dirty *d;
+    size_t first = offs >> MMU_PAGE_SHIFT;
+    size_t last = (offs + size + MMU_PAGE_SZ - 1) >> MMU_PAGE_SHIFT;
+
+    if(size == 0 || last > mmu->dirty_pages) {
+        LOGE("Invalid dirty tracking range $%zx+$%zx", offs, size);
+        return -1;
+    }
+    if(mmu->dirty_num == MMU_DIRTY_MAX) {
+        LOGE("No free dirty tracking slot");
+        return -1;
+    }
+
+    /* Writes made before now are not of interest to the new user. */
+    core_mmu__dirty_fold(mmu, first, last - first);
+    d = &mmu->dirty_users[mmu->dirty_num];
+    d->first = first;
+    d->num = last - first;
+    d->gen = mmu->dirty_now;
+
+    return mmu->dirty_num++;
+}
+
+
+/* Get and clear the pages a user has not yet seen written. */
+size_t core_mmu_dirty_get(struct core_mmu *mmu, int id, uint64_t *bitmap)
+{
+    struct core_mmu_dirty *d;
+    size_t i, n = 0;
+
+    if(id < 0 || id >= mmu->dirty_num) {
+        LOGW("core.mmu: dirty tracking user %d asked for, but only %d present",
+             id, mmu->dirty_num);
+        return 0;
+    }
+    d = &mmu->dirty_users[id];
+    core_mmu__dirty_fold(mmu, d->first, d->num);
+    memset(bitmap, 0, ((d->num + 63) / 64) * sizeof(uint64_t));
+    for(i = 0; i < d->num; ++i) {
+        if(mmu->dirty_gen[d->first + i] > d->gen) {
+            bitmap[i >> 6] |= (uint64_t)1 << (i & 63);
+            n += 1;
+        }
+    }
+    d->gen = mmu->dirty_now;
+
+    return n;
+}
+
+
 /* CPU memory operations. */
 /* Place a Read-Byte request on the bus. */
 int core_mmu_rb_send_cpu(struct core_mmu *mmu, uint16_t a)
@@ -283,6 +664,19 @@ uint8_t core_mmu_rb_fetch_cpu(struct core_mmu *mmu)
 }
 
 
+/*
+ * Place an instruction fetch request on the bus. The result is read back with
+ * core_mmu_rw_fetch_cpu.
+ */
+int core_mmu_fw_send_cpu(struct core_mmu *mmu, uint16_t a)
+{
+    mmu->pending_cpu = MMU_FETCH;
+    mmu->a_cpu = a;
+    mmu->vsz_cpu = 2;
+    return 1;
+}
+
+
 /* Place a Write-Byte request on the bus. */
 int core_mmu_wb_send_cpu(struct core_mmu *mmu, uint16_t a, uint8_t v)
 {
@@ -368,6 +762,22 @@ uint16_t core_mmu_rw_fetch_vpu(struct core_mmu *mmu)
 }
 
 
+/*
+ * Read a word for the VPU at once, outside of the bus's request cycle. It is
+ * counted as a request all the same.
+ */
+uint16_t core_mmu_rw_vpu(struct core_mmu *mmu, uint16_t a)
+{
+    if(mmu->stats != NULL) {
+        uint64_t (*c)[MMU_NUM_PAGES] = mmu->stats->frame[MMU_STATS_VPU];
+
+        c[MMU_STATS_READ][a >> MMU_PAGE_SHIFT] += 1;
+        c[MMU_STATS_READ][(uint16_t)(a + 1) >> MMU_PAGE_SHIFT] += 1;
+    }
+    return core_mmu_readw(mmu, a);
+}
+
+
 /* Place a Write-Word request on the bus. */
 int core_mmu_ww_send_vpu(struct core_mmu *mmu, uint16_t a, uint16_t v)
 {
@@ -382,11 +792,24 @@ int core_mmu_ww_send_vpu(struct core_mmu *mmu, uint16_t a, uint16_t v)
 /* Apply any pending memory operations on the bus. */
 void core_mmu_update(struct core_mmu *mmu)
 {
+    if(mmu->stats != NULL)
+        core_mmu__stats_count(mmu);
+
+    /* Let a VPU running behind catch up before the CPU touches what it sees. */
+    if(mmu->pending_cpu != MMU_NONE &&
+            mmu->a_cpu + mmu->vsz_cpu > A_TILE_SWAP && mmu->a_cpu <= A_VPU_END)
+        core_vpu_sync(mmu->vpu, mmu->cpu->total_cycles);
+
     if(mmu->pending_cpu == MMU_READ) {
         if(mmu->vsz_cpu == 1)
             mmu->v_cpu = core_mmu_readb(mmu, mmu->a_cpu);
         else
             mmu->v_cpu = core_mmu_readw(mmu, mmu->a_cpu);
+    } else if(mmu->pending_cpu == MMU_FETCH) {
+        mmu->v_cpu = core_mmu_readw(mmu, mmu->a_cpu);
+        if(mmu->page_watch[mmu->a_cpu >> MMU_PAGE_SHIFT] & MMU_WATCH_EXEC)
+            core_mmu__watch_check(mmu, mmu->a_cpu, MMU_WATCH_EXEC,
+                    mmu->v_cpu & 0xff);
     } else if(mmu->pending_cpu == MMU_WRITE) {
         if(mmu->vsz_cpu == 1)
             core_mmu_writeb(mmu, mmu->a_cpu, mmu->v_cpu);
@@ -427,107 +850,66 @@ static inline int core_mmu_pending_vpu(struct core_mmu *mmu)
 /* Read a byte from the correct device/bank for that address. */
 static uint8_t core_mmu_readb(struct core_mmu *mmu, uint16_t a)
 {
-    /* Check which memory bank to access, or which handler to use. */
-    if(a <= A_ROM_FIXED_END)
-        return mmu->rom_f[a - A_ROM_FIXED];
-    else if(a <= A_ROM_SWAP_END)
-        return mmu->rom_s[a - A_ROM_SWAP];
-    else if(a <= A_RAM_FIXED_END)
-        return mmu->ram_f[a - A_RAM_FIXED];
-    else if(a <= A_RAM_SWAP_END)
-        return mmu->ram_s[a - A_RAM_SWAP];
-    else if(a <= A_TILE_SWAP_END) {
-        return mmu->tile_s[a - A_TILE_SWAP];
-    } else if(a <= A_VPU_END)
-        return core_vpu_readb(mmu->vpu, a);
-    else if(a <= A_APU_END)
-        return 0;//mmu->apu_readb(a);
-    else if(a <= A_DPCM_SWAP_END)
-        return mmu->dpcm_s[a - A_DPCM_SWAP];
-    else if(a <= A_CART_FIXED_END)
-        return core_cart_readb(mmu->cart, a);
-    else if(a == A_ROM_BANK_SELECT)
-        return mmu->rom_s_bank;
-    else if(a == A_RAM_BANK_SELECT)
-        return mmu->ram_s_bank;
-    else if(a == A_HIRES_CTR)
-        return core_cpu_hrc_getlob(mmu->cpu->hrc);
-    else if(a == A_HIRES_CTR + 1)
-        return core_cpu_hrc_gethib(mmu->cpu->hrc);
-    else if(a <= A_SERIAL_REG_END)
-        LOGV("core.mmu: write @ address $%04x: serial stub", a);
-    else if(a >= A_PAD1_REG && a <= A_PAD1_REG_END)
-        LOGV("core.mmu: read  @ address $%04x: gamepad stub", a);
-    else if(a >= A_PAD2_REG && a <= A_PAD2_REG_END)
-        LOGV("core.mmu: read  @ address $%04x: gamepad stub", a);
-    else if(a <= A_INT_VEC_END) {
-        LOGV("core.mmu: read @ address $%04x: $%02x (p: $%04x)", a,
-             mmu->intvec[a - A_INT_VEC], mmu->cpu->r[R_P]);
-        return mmu->intvec[a - A_INT_VEC];
-    }
-    else {
-        LOGW("core.mmu: read  @ address $%04x: unhandled", a);
-        return 0;
-    }
+    uint8_t *p = mmu->page[a >> MMU_PAGE_SHIFT];
+
+    /* With the mirror, most plain memory is a single load. */
+    if(a < mmu->mirror_lim)
+        return mmu->mirror[a];
+
+    /* Plain memory is a single lookup in the page table. */
+    if(p != NULL)
+        return p[a & (MMU_PAGE_SZ - 1)];
+
+    /* Otherwise, hand over to whichever device owns the address. */
+    if(mmu->page_watch[a >> MMU_PAGE_SHIFT] != 0)
+        return core_mmu__watch_readb(mmu, a);
+    return core_mmu__io_readb(mmu, a);
 }
 
 
 /* Write a byte to the correct device/bank part for that address. */
 static void core_mmu_writeb(struct core_mmu *mmu, uint16_t a, uint8_t v)
 {
-    /* Check which memory bank to access, or which handler to use. */
-    if(a <= A_ROM_FIXED_END)
-        mmu->rom_f[a - A_ROM_FIXED] = v;
-    else if(a <= A_ROM_SWAP_END)
-        mmu->rom_s[a - A_ROM_SWAP] = v;
-    else if(a <= A_RAM_FIXED_END)
-        mmu->ram_f[a - A_RAM_FIXED] = v;
-    else if(a <= A_RAM_SWAP_END)
-        mmu->ram_s[a - A_RAM_SWAP] = v;
-    else if(a <= A_TILE_SWAP_END) {
-        mmu->tile_s[a - A_TILE_SWAP] = v;
-    } else if(a == A_TILE_BANK_SELECT)
-        core_mmu_bank_select(mmu, B_TILE_SWAP, v);
-    else if(a <= A_VPU_END)
-        core_vpu_writeb(mmu->vpu, a, v);
-    else if(a == A_DPCM_BANK_SELECT)
-        core_mmu_bank_select(mmu, B_DPCM_SWAP, v);
-    else if(a <= A_APU_END)
-        ;//mmu->apu_writeb(a, v);
-    else if(a <= A_DPCM_SWAP_END)
-        mmu->dpcm_s[a - A_DPCM_SWAP] = v;
-    else if(a <= A_FIXED0_END)
-        LOGW("core.mmu: write @ address $%04x: unhandled", a);
-    else if(a <= A_CART_FIXED_END)
-        core_cart_writeb(mmu->cart, a, v);
-    else if(a <= A_FIXED1_END)
-        LOGW("core.mmu: write @ address $%04x: unhandled (p:$%04x)", a, mmu->cpu->r[R_P]);
-    else if(a == A_ROM_BANK_SELECT)
-        core_mmu_bank_select(mmu, B_ROM_SWAP, v);
-    else if(a == A_RAM_BANK_SELECT)
-        core_mmu_bank_select(mmu, B_RAM_SWAP, v);
-    else if(a == A_HIRES_CTR)
-        core_cpu_hrc_setlob(mmu->cpu->hrc, v);
-    else if(a == A_HIRES_CTR + 1)
-        core_cpu_hrc_sethib(mmu->cpu->hrc, v);
-    else if(a <= A_SERIAL_REG_END)
-        LOGV("core.mmu: write @ address $%04x: serial stub", a);
-    else if(a <= A_INT_VEC_END) {
-        LOGV("core.mmu: write @ address $%04x: $%02x (p:$%04x)", a, v,
-             mmu->cpu->r[R_P]);
-        mmu->intvec[a - A_INT_VEC] = v;
-    }
-    else {
-        LOGW("core.mmu: write @ address $%04x: unhandled (p:$%04x)", a, mmu->cpu->r[R_P]);
+    uint8_t *p = mmu->page[a >> MMU_PAGE_SHIFT];
+
+    if(p != NULL) {
+        uint32_t d = mmu->page_dirty[a >> MMU_PAGE_SHIFT];
+
+        /* ROM banks may be mapped read-only from the file; writes are lost. */
+        if(a <= A_ROM_SWAP_END)
+            return;
+        p[a & (MMU_PAGE_SZ - 1)] = v;
+        mmu->dirty[d >> 6] |= (uint64_t)1 << (d & 63);
+        return;
     }
+
+    if(mmu->page_watch[a >> MMU_PAGE_SHIFT] != 0)
+        core_mmu__watch_writeb(mmu, a, v);
+    else
+        core_mmu__io_writeb(mmu, a, v);
 }
 
 
-/* Read a word from the correct device/bank part for that address. */
+/*
+ * Read a word from the correct device/bank part for that address.
+ * When both bytes are in the same page of plain memory, this is a single load;
+ * like the rest of the emulator, this assumes a little-endian host.
+ */
 static uint16_t core_mmu_readw(struct core_mmu *mmu, uint16_t a)
 {
+    uint8_t *p = mmu->page[a >> MMU_PAGE_SHIFT];
     uint16_t result = 0;
 
+    if(a + 1u < mmu->mirror_lim) {
+        memcpy(&result, mmu->mirror + a, 2);
+        return result;
+    }
+    if(p != NULL && (a & (MMU_PAGE_SZ - 1)) != MMU_PAGE_SZ - 1) {
+        memcpy(&result, p + (a & (MMU_PAGE_SZ - 1)), 2);
+        return result;
+    }
+
+    /* Otherwise, the bytes may be decoded differently; do them one by one. */
     result |= core_mmu_readb(mmu, a);
     result |= core_mmu_readb(mmu, a + 1) << 8;
 
@@ -538,7 +920,559 @@ static uint16_t core_mmu_readw(struct core_mmu *mmu, uint16_t a)
 /* Write a word to the correct device/bank part for that address. */
 static void core_mmu_writew(struct core_mmu *mmu, uint16_t a, uint16_t v)
 {
+    uint8_t *p = mmu->page[a >> MMU_PAGE_SHIFT];
+
+    if(p != NULL && (a & (MMU_PAGE_SZ - 1)) != MMU_PAGE_SZ - 1 &&
+            a > A_ROM_SWAP_END) {
+        uint32_t d = mmu->page_dirty[a >> MMU_PAGE_SHIFT];
+
+        memcpy(p + (a & (MMU_PAGE_SZ - 1)), &v, 2);
+        mmu->dirty[d >> 6] |= (uint64_t)1 << (d & 63);
+        return;
+    }
+
     core_mmu_writeb(mmu, a, (v & 0xff));
     core_mmu_writeb(mmu, a + 1, v >> 8);
 }
 
+
+
+/* Count the requests about to be applied on the bus. */
+static void core_mmu__stats_count(struct core_mmu *mmu)
+{
+    uint64_t (*c)[2][MMU_NUM_PAGES] = mmu->stats->frame;
+    int k;
+
+    if(mmu->pending_cpu != MMU_NONE) {
+        k = mmu->pending_cpu == MMU_WRITE ? MMU_STATS_WRITE : MMU_STATS_READ;
+        c[MMU_STATS_CPU][k][mmu->a_cpu >> MMU_PAGE_SHIFT] += 1;
+        if(mmu->vsz_cpu == 2)
+            c[MMU_STATS_CPU][k][(uint16_t)(mmu->a_cpu + 1) >> MMU_PAGE_SHIFT]
+                += 1;
+    }
+    if(mmu->pending_vpu != MMU_NONE) {
+        k = mmu->pending_vpu == MMU_WRITE ? MMU_STATS_WRITE : MMU_STATS_READ;
+        c[MMU_STATS_VPU][k][mmu->a_vpu >> MMU_PAGE_SHIFT] += 1;
+        if(mmu->vsz_vpu == 2)
+            c[MMU_STATS_VPU][k][(uint16_t)(mmu->a_vpu + 1) >> MMU_PAGE_SHIFT]
+                += 1;
+    }
+}
+
+
+/* Name the region of the address space a page belongs to. */
+static const char *core_mmu__region(unsigned int page)
+{
+    uint16_t a = page << MMU_PAGE_SHIFT;
+
+    if(a <= A_ROM_FIXED_END)
+        return "rom_fixed";
+    else if(a <= A_ROM_SWAP_END)
+        return "rom_swap";
+    else if(a <= A_RAM_FIXED_END)
+        return "ram_fixed";
+    else if(a <= A_RAM_SWAP_END)
+        return "ram_swap";
+    else if(a <= A_TILE_SWAP_END)
+        return "tile";
+    else if(a <= A_VPU_END)
+        return "vpu";
+    else if(a <= A_APU_END)
+        return "apu";
+    else if(a <= A_DPCM_SWAP_END)
+        return "dpcm";
+    else if(a >= A_CART_FIXED && a <= A_CART_FIXED_END)
+        return "cart";
+    else
+        return "misc";
+}
+
+
+/* Read a byte through the handlers of the device owning the address. */
+static uint8_t core_mmu__io_readb(struct core_mmu *mmu, uint16_t a)
+{
+    struct core_mmu_io *io = &mmu->io[mmu->io_map[a]];
+
+    if(io->readb == NULL) {
+        mmu->unmapped_reads += 1;
+        return 0;
+    }
+    return io->readb(io->ctx, a);
+}
+
+
+/* Write a byte through the handlers of the device owning the address. */
+static void core_mmu__io_writeb(struct core_mmu *mmu, uint16_t a, uint8_t v)
+{
+    struct core_mmu_io *io = &mmu->io[mmu->io_map[a]];
+
+    if(io->writeb == NULL) {
+        mmu->unmapped_writes += 1;
+        return;
+    }
+    io->writeb(io->ctx, a, v);
+}
+
+
+/* Read a byte from a page with a watchpoint. */
+static uint8_t core_mmu__watch_readb(struct core_mmu *mmu, uint16_t a)
+{
+    uint8_t *p = mmu->page_mem[a >> MMU_PAGE_SHIFT];
+    uint8_t v;
+
+    v = p != NULL ? p[a & (MMU_PAGE_SZ - 1)] : core_mmu__io_readb(mmu, a);
+    if(mmu->page_watch[a >> MMU_PAGE_SHIFT] & MMU_WATCH_READ)
+        core_mmu__watch_check(mmu, a, MMU_WATCH_READ, v);
+    return v;
+}
+
+
+/* Write a byte to a page with a watchpoint. */
+static void core_mmu__watch_writeb(struct core_mmu *mmu, uint16_t a, uint8_t v)
+{
+    uint8_t *p = mmu->page_mem[a >> MMU_PAGE_SHIFT];
+
+    if(mmu->page_watch[a >> MMU_PAGE_SHIFT] & MMU_WATCH_WRITE)
+        core_mmu__watch_check(mmu, a, MMU_WATCH_WRITE, v);
+    if(a <= A_ROM_SWAP_END)
+        return;
+    if(p != NULL) {
+        uint32_t d = mmu->page_dirty[a >> MMU_PAGE_SHIFT];
+
+        p[a & (MMU_PAGE_SZ - 1)] = v;
+        mmu->dirty[d >> 6] |= (uint64_t)1 << (d & 63);
+        if((mmu->page_watch[a >> MMU_PAGE_SHIFT] & MMU_WATCH_HOOK) &&
+                a >= mmu->hook_start && a <= mmu->hook_end)
+            mmu->hook_fn(mmu->hook_ctx, a, v);
+    } else {
+        core_mmu__io_writeb(mmu, a, v);
+    }
+}
+
+
+/* Trigger the watchpoints of the given kind covering an address. */
+static void core_mmu__watch_check(struct core_mmu *mmu, uint16_t a, int kind,
+        uint8_t v)
+{
+    const char *kinds[] = { "", "read", "write", "", "exec" };
+    int i;
+
+    for(i = 0; i < mmu->watch_num; ++i) {
+        struct core_mmu_watch *w = &mmu->watch[i];
+
+        if(!(w->flags & kind) || a < w->start || a > w->end)
+            continue;
+        if(mmu->watch_fn != NULL)
+            mmu->watch_fn(mmu->watch_ctx, a, kind, v);
+        else
+            LOGW("core.mmu: watchpoint: %s @ $%04x: $%02x (p:$%04x)",
+                 kinds[kind], a, v, mmu->cpu ? mmu->cpu->r[R_P] : 0);
+        return;
+    }
+}
+
+
+/*
+ * Recompute the watched kinds of each page after the watchpoints or the write
+ * hook changed. Pages watched for reads or writes, or hooked, are taken off
+ * the fast path; execution is checked on instruction fetches instead, so does
+ * not need that.
+ */
+static void core_mmu__watch_pages(struct core_mmu *mmu)
+{
+    int i, j;
+
+    memset(mmu->page_watch, 0, sizeof(mmu->page_watch));
+    for(i = 0; i < mmu->watch_num; ++i) {
+        struct core_mmu_watch *w = &mmu->watch[i];
+
+        for(j = w->start >> MMU_PAGE_SHIFT; j <= w->end >> MMU_PAGE_SHIFT; ++j)
+            mmu->page_watch[j] |= w->flags;
+    }
+    if(mmu->hook_fn != NULL)
+        for(j = mmu->hook_start >> MMU_PAGE_SHIFT;
+                j <= mmu->hook_end >> MMU_PAGE_SHIFT; ++j)
+            mmu->page_watch[j] |= MMU_WATCH_HOOK;
+    for(i = 0; i < MMU_NUM_PAGES; ++i) {
+        if(mmu->page_watch[i] & MMU_WATCH_SLOW)
+            mmu->page[i] = NULL;
+        else
+            mmu->page[i] = mmu->page_mem[i];
+    }
+    core_mmu__mirror_limit(mmu);
+}
+
+
+/* Reserve an aligned region of the given size in the arena layout. */
+static size_t core_mmu__arena_carve(struct core_mmu_arena *ar, size_t size)
+{
+    size_t offs = (ar->size + ar->align - 1) & ~(ar->align - 1);
+
+    ar->size = offs + size;
+    return offs;
+}
+
+
+/*
+ * Map the arena. Anonymous mappings are page aligned and come zeroed, and are
+ * only backed by memory once touched. With huge pages requested, the mapping
+ * is widened so a 2 MB aligned window can be handed to the kernel.
+ * A shared arena is backed by a memfd instead, so that its pages can be mapped
+ * a second time; huge pages are not used for it.
+ */
+static int core_mmu__arena_alloc(struct core_mmu_arena *ar, int hugepages,
+        int shared)
+{
+    size_t align, size, map_size;
+    uint8_t *map;
+
+    if(shared) {
+#ifdef MFD_CLOEXEC
+        ar->fd = memfd_create("qpra-arena", MFD_CLOEXEC);
+#endif
+        if(ar->fd < 0 || ftruncate(ar->fd, (ar->size + 4095) & ~4095) != 0) {
+            LOGW("core.mmu: could not create a shared arena");
+            if(ar->fd >= 0)
+                close(ar->fd);
+            ar->fd = -1;
+        } else if(hugepages) {
+            LOGW("core.mmu: huge pages are not used with the mirror");
+        }
+    }
+    if(ar->fd >= 0)
+        hugepages = 0;
+
+    align = hugepages ? MMU_HUGEPAGE_SZ : 4096;
+    size = (ar->size + align - 1) & ~(align - 1);
+    map_size = hugepages ? size + align : size;
+    if(ar->fd >= 0)
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                ar->fd, 0);
+    else
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED) {
+        LOGE("Could not map %zu byte memory arena", map_size);
+        return 0;
+    }
+    ar->map = map;
+    ar->map_size = map_size;
+    ar->base = (uint8_t *)(((uintptr_t)map + align - 1) & ~(align - 1));
+    ar->hugepages = 0;
+
+#ifdef MADV_HUGEPAGE
+    if(hugepages) {
+        if(madvise(ar->base, size, MADV_HUGEPAGE) == 0)
+            ar->hugepages = 1;
+        else
+            LOGW("core.mmu: transparent huge pages unavailable");
+    }
+#endif
+    return 1;
+}
+
+
+/* Unmap the arena. */
+static void core_mmu__arena_free(struct core_mmu_arena *ar)
+{
+    if(ar->map != NULL)
+        munmap(ar->map, ar->map_size);
+    ar->map = ar->base = NULL;
+    if(ar->fd >= 0)
+        close(ar->fd);
+    ar->fd = -1;
+}
+
+
+/*
+ * Reserve the 64 KB of host address space for the mirror. It starts out
+ * inaccessible; windows are mapped into it as regions are mapped in.
+ */
+static int core_mmu__mirror_init(struct core_mmu *mmu)
+{
+    uint8_t *m;
+
+    if(mmu->arena.fd < 0)
+        return 0;
+    if(sysconf(_SC_PAGESIZE) != MMU_MIRROR_ALIGN) {
+        LOGW("core.mmu: mirror needs %d byte host pages", MMU_MIRROR_ALIGN);
+        return 0;
+    }
+
+    m = mmap(NULL, 0x10000, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED) {
+        LOGW("core.mmu: could not reserve the mirror");
+        return 0;
+    }
+    mmu->mirror = m;
+    return 1;
+}
+
+
+/*
+ * Map the arena pages at offset slot into the mirror, at the window for
+ * [start, end]. On failure, the mirror is given up on: the page table holds
+ * the same mappings, so accesses carry on through it.
+ */
+static void core_mmu__mirror_map(struct core_mmu *mmu, uint16_t start,
+        uint16_t end, size_t slot)
+{
+    void *m;
+
+    if(mmu->mirror == NULL || end >= MMU_MIRROR_END)
+        return;
+
+    m = mmap(mmu->mirror + start, end - start + 1, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, mmu->arena.fd, slot);
+    if(m == MAP_FAILED) {
+        LOGE("core.mmu: could not map $%04x-$%04x in the mirror", start, end);
+        munmap(mmu->mirror, 0x10000);
+        mmu->mirror = NULL;
+        mmu->mirror_lim = 0;
+    }
+}
+
+
+/*
+ * Serve reads from the mirror up to the first page which must go through the
+ * page table, namely one with a watchpoint.
+ */
+static void core_mmu__mirror_limit(struct core_mmu *mmu)
+{
+    unsigned int i;
+
+    if(mmu->mirror == NULL) {
+        mmu->mirror_lim = 0;
+        return;
+    }
+    for(i = 0; i < MMU_MIRROR_END >> MMU_PAGE_SHIFT; ++i)
+        if(mmu->page[i] == NULL)
+            break;
+    mmu->mirror_lim = i << MMU_PAGE_SHIFT;
+}
+
+
+/*
+ * Return the storage to use for a bank: the ROM file's own pages if the bank
+ * was mapped from it and the arena is not mirrored, or else the arena slot, filled from the source if there
+ * is one. The source is consumed either way; with no slot, it is just freed.
+ */
+static uint8_t *core_mmu__bank_init(struct core_mmu *mmu, uint8_t **src,
+        uint8_t *slot, size_t size)
+{
+    uint8_t *file = mmu->src->file;
+    uint8_t *p = *src;
+
+    *src = NULL;
+    if(p == NULL)
+        return slot;
+    if(p >= file && p + size <= file + mmu->src->file_size) {
+        /* The mirror can only map the arena, so then the bank is copied. */
+        if(mmu->arena.fd < 0 || slot == NULL)
+            return p;
+        memcpy(slot, p, size);
+        return slot;
+    }
+    if(slot != NULL)
+        memcpy(slot, p, size);
+    free(p);
+    return slot;
+}
+
+
+/*
+ * Return the storage for a switchable bank, setting it up the first time it
+ * is asked for. Until then, a bank costs nothing: its arena slot is never
+ * touched, and banks mapped from the ROM file are not read.
+ */
+static uint8_t *core_mmu__bank(struct core_mmu *mmu, enum core_mmu_bank bank,
+        uint8_t index, size_t *slot)
+{
+    struct core_mmu_arena *ar = &mmu->arena;
+    uint8_t **tab, **src;
+    size_t offs, size;
+
+    switch(bank) {
+        case B_ROM_SWAP:
+            tab = mmu->rom_s_banks, src = mmu->src->rom_s;
+            offs = ar->rom_s, size = MMU_ROM_BANK_SZ;
+            break;
+        case B_RAM_SWAP:
+            tab = mmu->ram_s_banks, src = mmu->src->ram_s;
+            offs = ar->ram_s, size = MMU_RAM_BANK_SZ;
+            break;
+        case B_TILE_SWAP:
+            tab = mmu->tile_s_banks, src = mmu->src->tile_s;
+            offs = ar->tile_s, size = MMU_TILE_BANK_SZ;
+            break;
+        default:
+            tab = mmu->dpcm_s_banks, src = mmu->src->dpcm_s;
+            offs = ar->dpcm_s, size = MMU_DPCM_BANK_SZ;
+            break;
+    }
+
+    *slot = offs + index*size;
+    if(tab[index] == NULL) {
+        tab[index] = core_mmu__bank_init(mmu, &src[index],
+                ar->base + *slot, size);
+        mmu->banks_touched += 1;
+    }
+    return tab[index];
+}
+
+
+/*
+ * Point the pages covering [start, end] at consecutive bytes of mem, whose
+ * writes are tracked against the arena slot at offset slot. Banks used in
+ * place from the ROM file still have their slot, so are tracked all the same.
+ */
+static void core_mmu__map_pages(struct core_mmu *mmu, uint16_t start,
+        uint16_t end, uint8_t *mem, size_t slot)
+{
+    int i;
+
+    for(i = start >> MMU_PAGE_SHIFT; i <= end >> MMU_PAGE_SHIFT; ++i) {
+        mmu->page_mem[i] = mem + ((i << MMU_PAGE_SHIFT) - start);
+        if(mmu->page_watch[i] & MMU_WATCH_SLOW)
+            mmu->page[i] = NULL;
+        else
+            mmu->page[i] = mmu->page_mem[i];
+        mmu->page_dirty[i] = (slot + ((i << MMU_PAGE_SHIFT) - start))
+            >> MMU_PAGE_SHIFT;
+    }
+    core_mmu__mirror_map(mmu, start, end, slot);
+}
+
+
+/*
+ * Move the dirty bits of a range of arena pages into their generation stamps,
+ * clearing them. All pages found dirty get the same, new generation.
+ */
+static void core_mmu__dirty_fold(struct core_mmu *mmu, size_t first,
+        size_t num)
+{
+    size_t i, end = first + num;
+    int stamped = 0;
+
+    for(i = first; i < end; ++i) {
+        uint64_t bit = (uint64_t)1 << (i & 63);
+
+        /* Skip over clean words in one go. */
+        if(mmu->dirty[i >> 6] == 0) {
+            i |= 63;
+            continue;
+        }
+        if(!(mmu->dirty[i >> 6] & bit))
+            continue;
+        if(!stamped) {
+            mmu->dirty_now += 1;
+            stamped = 1;
+        }
+        mmu->dirty[i >> 6] &= ~bit;
+        mmu->dirty_gen[i] = mmu->dirty_now;
+    }
+}
+
+
+/* I/O handlers for the MMU's bank selection registers. */
+static uint8_t core_mmu__bank_readb(void *ctx, uint16_t a)
+{
+    struct core_mmu *mmu = ctx;
+
+    if(a == A_ROM_BANK_SELECT)
+        return mmu->rom_s_bank;
+    else if(a == A_RAM_BANK_SELECT)
+        return mmu->ram_s_bank;
+    else if(a == A_TILE_BANK_SELECT)
+        return mmu->tile_bank;
+    else
+        return mmu->dpcm_bank;
+}
+
+static void core_mmu__bank_writeb(void *ctx, uint16_t a, uint8_t v)
+{
+    struct core_mmu *mmu = ctx;
+
+    if(a == A_ROM_BANK_SELECT)
+        core_mmu_bank_select(mmu, B_ROM_SWAP, v);
+    else if(a == A_RAM_BANK_SELECT)
+        core_mmu_bank_select(mmu, B_RAM_SWAP, v);
+    else if(a == A_TILE_BANK_SELECT)
+        core_mmu_bank_select(mmu, B_TILE_SWAP, v);
+    else
+        core_mmu_bank_select(mmu, B_DPCM_SWAP, v);
+}
+
+
+/* I/O handlers for the interrupt vector. */
+static uint8_t core_mmu__intvec_readb(void *ctx, uint16_t a)
+{
+    struct core_mmu *mmu = ctx;
+
+    LOGV("core.mmu: read @ address $%04x: $%02x (p: $%04x)", a,
+         mmu->intvec[a - A_INT_VEC], mmu->cpu->r[R_P]);
+    return mmu->intvec[a - A_INT_VEC];
+}
+
+static void core_mmu__intvec_writeb(void *ctx, uint16_t a, uint8_t v)
+{
+    struct core_mmu *mmu = ctx;
+
+    LOGV("core.mmu: write @ address $%04x: $%02x (p:$%04x)", a, v,
+         mmu->cpu->r[R_P]);
+    mmu->intvec[a - A_INT_VEC] = v;
+}
+
+
+/* I/O handlers forwarding to the CPU's high resolution counter. */
+static uint8_t core_mmu__hrc_readb(void *ctx, uint16_t a)
+{
+    struct core_cpu *cpu = ctx;
+
+    if(a == A_HIRES_CTR)
+        return core_cpu_hrc_getlob(cpu->hrc);
+    return core_cpu_hrc_gethib(cpu->hrc);
+}
+
+static void core_mmu__hrc_writeb(void *ctx, uint16_t a, uint8_t v)
+{
+    struct core_cpu *cpu = ctx;
+
+    if(a == A_HIRES_CTR)
+        core_cpu_hrc_setlob(cpu->hrc, v);
+    else
+        core_cpu_hrc_sethib(cpu->hrc, v);
+}
+
+
+/* I/O handlers forwarding to the VPU. */
+static uint8_t core_mmu__vpu_readb(void *ctx, uint16_t a)
+{
+    return core_vpu_readb(ctx, a);
+}
+
+static void core_mmu__vpu_writeb(void *ctx, uint16_t a, uint8_t v)
+{
+    struct core_vpu *vpu = ctx;
+    struct core_mmu *mmu = vpu->mmu;
+    size_t d = (mmu->arena.vpu_mem + (a - A_VPU_START)) >> MMU_PAGE_SHIFT;
+
+    /*
+     * VPU memory lives in the arena too, so is tracked like a plain page,
+     * though only writes the VPU let through change it.
+     */
+    if(core_vpu_writeb(vpu, a, v))
+        mmu->dirty[d >> 6] |= (uint64_t)1 << (d & 63);
+}
+
+
+/* I/O handlers forwarding to the cart. */
+static uint8_t core_mmu__cart_readb(void *ctx, uint16_t a)
+{
+    return core_cart_readb(ctx, a);
+}
+
+static void core_mmu__cart_writeb(void *ctx, uint16_t a, uint8_t v)
+{
+    core_cart_writeb(ctx, a, v);
+}
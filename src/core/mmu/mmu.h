@@ -11,6 +11,7 @@
 #ifndef QPRA_CORE_MMU_H
 #define QPRA_CORE_MMU_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Segments of the address space which we handle. */
@@ -51,6 +52,62 @@ static const uint16_t A_INT_VEC = 0xfff8;
 static const uint16_t A_INT_VEC_END = 0xffff;
 
 
+/* Granularity of the address decoding: the space is split into 256 pages. */
+#define MMU_PAGE_SHIFT      8
+#define MMU_PAGE_SZ         (1 << MMU_PAGE_SHIFT)
+#define MMU_NUM_PAGES       (0x10000 >> MMU_PAGE_SHIFT)
+
+/* Sizes of the memory banks and other areas owned by the MMU. */
+#define MMU_ROM_BANK_SZ     0x4000
+#define MMU_RAM_BANK_SZ     0x2000
+#define MMU_TILE_BANK_SZ    0x2000
+#define MMU_DPCM_BANK_SZ    0x0800
+#define MMU_FIXED0_SZ       0x0600
+#define MMU_FIXED1_SZ       0x0100
+#define MMU_VPU_MEM_SZ      0x0c00
+#define MMU_VPU_FB_SZ       (256 * 224 * 4)
+#define MMU_VPU_FB_NUM      3
+
+/*
+ * Alignment of each area within the arena: one page of the address space, so
+ * that every page of a bank falls on its own page of the arena.
+ */
+#define MMU_ARENA_ALIGN     MMU_PAGE_SZ
+#define MMU_HUGEPAGE_SZ     (2 * 1024 * 1024)
+
+/*
+ * The part of the address space which the host mirror covers: every plain
+ * memory region from $0000 up to the VPU. Bank windows there are at least
+ * 8 KB, so each can be mapped on its own with 4 KB host pages.
+ */
+#define MMU_MIRROR_END      0xe000
+#define MMU_MIRROR_ALIGN    4096
+
+/* Maximum number of I/O ranges which can be registered, including slot 0. */
+#define MMU_IO_MAX          32
+
+/* Maximum number of independent users of the dirty page tracking. */
+#define MMU_DIRTY_MAX       8
+
+/* Maximum number of devices which can be told about bank switches. */
+#define MMU_OBSERVER_MAX    8
+
+/* Kinds of access a watchpoint triggers on, and how many there can be. */
+#define MMU_WATCH_READ      1
+#define MMU_WATCH_WRITE     2
+#define MMU_WATCH_EXEC      4
+#define MMU_WATCH_MAX       16
+/* Marks pages with a write hook, which leave the fast path like watched ones. */
+#define MMU_WATCH_HOOK      8
+#define MMU_WATCH_SLOW      (MMU_WATCH_READ | MMU_WATCH_WRITE | MMU_WATCH_HOOK)
+
+/* Devices placing requests on the bus, and kinds of access, for statistics. */
+#define MMU_STATS_CPU       0
+#define MMU_STATS_VPU       1
+#define MMU_STATS_READ      0
+#define MMU_STATS_WRITE     1
+
+
 /* Memory bank names, for the core_mmu_bank_select function. */ 
 enum core_mmu_bank 
 {
@@ -64,10 +121,112 @@ struct core_mmu_params
     uint8_t ram_banks;
     uint8_t tile_banks;
     uint8_t dpcm_banks;
+    /* Ask for the arena to be backed by transparent huge pages. */
+    int hugepages;
+    /* Ask for a host mirror of the address space; see core_mmu.mirror. */
+    int mirror;
 };
 
 enum core_mmu_access {
-    MMU_NONE, MMU_READ, MMU_WRITE
+    MMU_NONE, MMU_READ, MMU_WRITE, MMU_FETCH
+};
+
+/* Device handlers for reads and writes in a memory-mapped I/O range. */
+typedef uint8_t (*core_mmu_io_readb)(void *, uint16_t);
+typedef void (*core_mmu_io_writeb)(void *, uint16_t, uint8_t);
+
+struct core_mmu_io
+{
+    uint16_t start;
+    uint16_t end;
+    core_mmu_io_readb readb;
+    core_mmu_io_writeb writeb;
+    void *ctx;
+};
+
+/*
+ * Called after a bank switch, with the bank kind, the index now selected and
+ * the memory now mapped in for it.
+ */
+typedef void (*core_mmu_bank_fn)(void *, enum core_mmu_bank, uint8_t,
+        uint8_t *);
+
+struct core_mmu_observer
+{
+    core_mmu_bank_fn fn;
+    void *ctx;
+};
+
+/* A watchpoint on the address range [start, end]. */
+struct core_mmu_watch
+{
+    uint16_t start;
+    uint16_t end;
+    int flags;
+};
+
+/*
+ * Called when a watchpoint triggers, with the address, the MMU_WATCH_* kind
+ * of access and the byte read or written.
+ */
+typedef void (*core_mmu_watch_hit)(void *, uint16_t, int, uint8_t);
+
+/* Called after a write to hooked memory, with the address and the byte. */
+typedef void (*core_mmu_write_fn)(void *, uint16_t, uint8_t);
+
+/*
+ * Bus access counts for each page of the address space, by requesting device
+ * and by kind of access. The current frame is folded into the session total,
+ * and kept as the last frame, by core_mmu_stats_frame.
+ */
+struct core_mmu_stats
+{
+    uint64_t frame[2][2][MMU_NUM_PAGES];
+    uint64_t last[2][2][MMU_NUM_PAGES];
+    uint64_t session[2][2][MMU_NUM_PAGES];
+    unsigned int frames;
+};
+
+/*
+ * A user of the dirty page tracking, watching a range of arena pages. It sees
+ * the pages written since the generation of its last query.
+ */
+struct core_mmu_dirty
+{
+    size_t first;
+    size_t num;
+    uint32_t gen;
+};
+
+struct core_temp_banks;
+
+/*
+ * A single allocation holding every memory area of an instance. The offsets
+ * of each area within it are recorded, so that it can be copied wholesale.
+ */
+struct core_mmu_arena
+{
+    uint8_t *base;
+    size_t size;
+    size_t align;
+    int hugepages;
+    /* A memfd backing the arena, if it needs mapping twice; or -1. */
+    int fd;
+
+    size_t rom_f;
+    size_t rom_s;
+    size_t ram_f;
+    size_t ram_s;
+    size_t tile_s;
+    size_t dpcm_s;
+    size_t fixed0_f;
+    size_t fixed1_f;
+    size_t vpu_mem;
+    size_t vpu_fb;
+
+    /* The underlying mapping, which may be larger for alignment. */
+    uint8_t *map;
+    size_t map_size;
 };
 
 /* Structure holding pointers to the memory banks, as well as handlers for
@@ -79,7 +238,20 @@ struct core_mmu
     struct core_vpu *vpu;
     struct core_cart *cart;
 
-    /* The memory banks. */
+    /* Backing storage for all of the memory below. */
+    struct core_mmu_arena arena;
+
+    /* Every switchable bank, indexed by bank number; NULL until selected. */
+    uint8_t *rom_s_banks[256];
+    uint8_t *ram_s_banks[256];
+    uint8_t *tile_s_banks[256];
+    uint8_t *dpcm_s_banks[256];
+    /* ROM file contents for the banks not yet selected. */
+    struct core_temp_banks *src;
+    /* How many switchable banks this session has selected. */
+    int banks_touched;
+
+    /* The memory banks currently mapped in. */
     uint8_t *rom_f;
     uint8_t *rom_s;
     uint8_t *ram_f;
@@ -112,6 +284,71 @@ struct core_mmu
     uint8_t dpcm_bank;
     uint8_t dpcm_s_total;
 
+    /* Devices to tell about bank switches. */
+    struct core_mmu_observer observers[MMU_OBSERVER_MAX];
+    int observer_num;
+
+    /*
+     * Host pointer to the start of each page of plain memory, or NULL for
+     * pages which are decoded through the I/O handlers below, or watched.
+     */
+    uint8_t *page[MMU_NUM_PAGES];
+    /* The same, whether watched or not. */
+    uint8_t *page_mem[MMU_NUM_PAGES];
+
+    /*
+     * Watchpoints, and the union of their kinds over each page. Only pages
+     * with a watchpoint leave the fast path, to have the ranges checked.
+     */
+    struct core_mmu_watch watch[MMU_WATCH_MAX];
+    int watch_num;
+    uint8_t page_watch[MMU_NUM_PAGES];
+    core_mmu_watch_hit watch_fn;
+    void *watch_ctx;
+
+    /* A device told about every write to [hook_start, hook_end], if any. */
+    core_mmu_write_fn hook_fn;
+    void *hook_ctx;
+    uint16_t hook_start;
+    uint16_t hook_end;
+
+    /* Registered I/O ranges. Slot 0 handles unmapped addresses. */
+    struct core_mmu_io io[MMU_IO_MAX];
+    int io_num;
+    /* I/O slot index for each address; only consulted for NULL pages. */
+    uint8_t io_map[0x10000];
+
+    /*
+     * Dirty page tracking, in units of MMU_PAGE_SZ bytes of the arena. Writes
+     * set a bit in the bitmap; queries fold those bits into a per-page
+     * generation stamp, so that each user can tell what it has not yet seen.
+     */
+    uint32_t page_dirty[MMU_NUM_PAGES];   /* Arena page of each guest page */
+    uint64_t *dirty;
+    uint32_t *dirty_gen;
+    uint32_t dirty_now;
+    size_t dirty_pages;
+    struct core_mmu_dirty dirty_users[MMU_DIRTY_MAX];
+    int dirty_num;
+
+    /* Accesses which did not hit any memory or device. */
+    uint64_t unmapped_reads;
+    uint64_t unmapped_writes;
+
+    /*
+     * Host mirror of the address space, if enabled: 64 KB of address space in
+     * which the bank windows below MMU_MIRROR_END map the arena pages of the
+     * banks selected, so guest address a is simply mirror[a]. Reads below
+     * mirror_lim are served from it; the rest, including I/O, is left
+     * inaccessible and goes through the page table. mirror_lim is 0 when the
+     * mirror is not in use.
+     */
+    uint8_t *mirror;
+    unsigned int mirror_lim;
+
+    /* Bus access statistics; NULL unless enabled. */
+    struct core_mmu_stats *stats;
+
     /* MDR, MAR and state for read/write requests. */
     enum core_mmu_access pending_cpu, pending_vpu;
     uint16_t a_cpu, a_vpu;
@@ -119,8 +356,6 @@ struct core_mmu
     size_t vsz_cpu, vsz_vpu;
 };
 
-struct core_temp_banks;
-
 /* Function declarations. */
 int core_mmu_init(struct core_mmu **, struct core_mmu_params *,
         struct core_temp_banks *);
@@ -130,6 +365,65 @@ int core_mmu_cart(struct core_mmu *, struct core_cart *);
 int core_mmu_destroy(struct core_mmu *);
 
 int core_mmu_bank_select(struct core_mmu *, enum core_mmu_bank, uint8_t);
+/*
+ * Subscribe to bank switches, so that a device holding on to a bank's memory
+ * only needs to look again when it changes. A device freed before the MMU
+ * must unsubscribe first.
+ */
+int core_mmu_bank_observe(struct core_mmu *, core_mmu_bank_fn, void *);
+int core_mmu_bank_unobserve(struct core_mmu *, core_mmu_bank_fn, void *);
+
+/*
+ * Register handlers for the I/O range [start, end]. Addresses already claimed
+ * by an earlier registration keep their handler, so narrower ranges must be
+ * registered before the ranges which contain them. Either handler may be NULL,
+ * in which case that kind of access is treated as unmapped.
+ * Pages touched by the range are decoded through the handlers as a whole.
+ */
+int core_mmu_map_io(struct core_mmu *, uint16_t, uint16_t,
+        core_mmu_io_readb, core_mmu_io_writeb, void *);
+
+/*
+ * Add a watchpoint on [start, end] for the MMU_WATCH_* kinds in flags.
+ * Watchpoints call the function set with core_mmu_watch_callback, or just log
+ * the access if there is none.
+ */
+int core_mmu_watch_add(struct core_mmu *, uint16_t, uint16_t, int);
+/* Remove the watchpoints lying within [start, end]; return how many. */
+int core_mmu_watch_remove(struct core_mmu *, uint16_t, uint16_t);
+void core_mmu_watch_callback(struct core_mmu *, core_mmu_watch_hit, void *);
+/*
+ * Call a function after every write to plain memory in [start, end], e.g. for
+ * a device keeping its own copy of it; the pages leave the fast path. There is
+ * one hook; a NULL function removes it.
+ */
+int core_mmu_write_hook(struct core_mmu *, uint16_t, uint16_t,
+        core_mmu_write_fn, void *);
+
+/*
+ * Bus access statistics. Once enabled, every request is counted against its
+ * page; the frame function is called at the end of each frame. The export
+ * function writes either the session or the last frame's counts, as CSV if
+ * the file name ends in ".csv", or else as a binary dump.
+ */
+int core_mmu_stats_enable(struct core_mmu *);
+void core_mmu_stats_frame(struct core_mmu *);
+int core_mmu_stats_export(struct core_mmu *, const char *, int);
+
+/*
+ * Track writes to the arena range [offs, offs + size), e.g. the tile banks
+ * starting at arena.tile_s. Returns an identifier for core_mmu_dirty_get, or
+ * -1 if no more users can be registered.
+ */
+int core_mmu_dirty_register(struct core_mmu *, size_t, size_t);
+
+/*
+ * Fill the bitmap with the pages of a user's range written since its last
+ * query (bit i for the i-th page of the range), and return how many there are.
+ * The bitmap must hold one bit per page of the range. An unknown user gets 0,
+ * and the bitmap is left alone.
+ */
+size_t core_mmu_dirty_get(struct core_mmu *, int, uint64_t *);
 
 /*
  * Emulate 1-cycle memory access delay by using a two-step access: in cycle 0,
@@ -140,6 +434,8 @@ int core_mmu_bank_select(struct core_mmu *, enum core_mmu_bank, uint8_t);
  */
 int core_mmu_rb_send_cpu(struct core_mmu *, uint16_t);
 uint8_t core_mmu_rb_fetch_cpu(struct core_mmu *);
+/* Read an instruction word; the same as a word read, save for watchpoints. */
+int core_mmu_fw_send_cpu(struct core_mmu *, uint16_t);
 int core_mmu_wb_send_cpu(struct core_mmu *, uint16_t, uint8_t);
 
 int core_mmu_rb_send_vpu(struct core_mmu *, uint16_t);
@@ -157,6 +453,8 @@ int core_mmu_ww_send_cpu(struct core_mmu *, uint16_t, uint16_t);
 int core_mmu_rw_send_vpu(struct core_mmu *, uint16_t);
 uint16_t core_mmu_rw_fetch_vpu(struct core_mmu *);
 int core_mmu_ww_send_vpu(struct core_mmu *, uint16_t, uint16_t);
+/* Read a word for the VPU straight away, for fetches not sharing the bus. */
+uint16_t core_mmu_rw_vpu(struct core_mmu *, uint16_t);
 
 int core_mmu_rw_send_cart(struct core_mmu *, uint16_t);
 uint16_t core_mmu_rw_fetch_cart(struct core_mmu *);
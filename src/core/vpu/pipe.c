@@ -0,0 +1,315 @@
+/*
+ * core/vpu/pipe.c -- VPU render thread.
+ *
+ * Moves drawing off the CPU thread: writes to video memory are logged with
+ * the cycle they land on, and a second VPU instance replays them against its
+ * own copies of video memory, drawing the frames on a thread of its own.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "core/vpu/pipe.h"
+#include "core/vpu/vpu.h"
+#include "core/cpu/cpu.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+static void core_vpu_pipe__tile_written(void *, uint16_t, uint8_t);
+static void core_vpu_pipe__bank_switched(void *, enum core_mmu_bank, uint8_t,
+        uint8_t *);
+static void core_vpu_pipe__copy_bank(struct core_vpu_pipe *, uint8_t,
+        const uint8_t *);
+static int core_vpu_pipe__wait(struct core_vpu_pipe *, uint64_t *);
+static void core_vpu_pipe__apply(struct core_vpu_pipe *,
+        const struct core_vpu_event *);
+static uint8_t core_vpu_pipe__readb(struct core_vpu_pipe *, uint16_t);
+static void *core_vpu_pipe__main(void *);
+
+
+/*
+ * Copy video memory and the tile banks switched in so far, then start logging
+ * writes to them and run the render thread from the current cycle.
+ */
+int core_vpu_pipe_start(struct core_vpu_pipe **ppipe, struct core_vpu *vpu)
+{
+    struct core_mmu *mmu = vpu->mmu;
+    struct core_vpu_pipe *pipe;
+    int i;
+
+    *ppipe = NULL;
+    pipe = calloc(1, sizeof(struct core_vpu_pipe));
+    if(pipe == NULL) {
+        LOGE("Could not allocate the VPU render thread");
+        return 0;
+    }
+    pipe->vpu = vpu;
+    pipe->num_banks = mmu->tile_s_total;
+    pipe->tiles = calloc(pipe->num_banks > 0 ? pipe->num_banks : 1,
+            MMU_TILE_BANK_SZ);
+    if(pipe->tiles == NULL) {
+        LOGE("Could not allocate the render thread's tile banks");
+        free(pipe);
+        return 0;
+    }
+
+    memcpy(pipe->mem, vpu->mem, MMU_VPU_MEM_SZ);
+    for(i = 0; i < pipe->num_banks; ++i)
+        if(mmu->tile_s_banks[i] != NULL)
+            core_vpu_pipe__copy_bank(pipe, i, mmu->tile_s_banks[i]);
+    if(!core_vpu_init_replica(&pipe->render, vpu, pipe->mem)) {
+        free(pipe->tiles);
+        free(pipe);
+        return 0;
+    }
+    pipe->render->pipe = pipe;
+    if(pipe->copied[vpu->tile_bank_num])
+        pipe->render->tile_bank = pipe->tiles +
+            (size_t)vpu->tile_bank_num * MMU_TILE_BANK_SZ;
+
+    pipe->next = vpu->cpu->total_cycles;
+    atomic_init(&pipe->head, 0);
+    atomic_init(&pipe->tail, 0);
+    atomic_init(&pipe->horizon, pipe->next);
+    atomic_init(&pipe->sleeping, 0);
+    atomic_init(&pipe->quit, 0);
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->wake, NULL);
+
+    if(!core_mmu_write_hook(mmu, A_TILE_SWAP, A_TILE_SWAP_END,
+                core_vpu_pipe__tile_written, pipe) ||
+            !core_mmu_bank_observe(mmu, core_vpu_pipe__bank_switched, pipe) ||
+            pthread_create(&pipe->thread, NULL, core_vpu_pipe__main, pipe)) {
+        LOGE("Could not start the VPU render thread");
+        core_mmu_write_hook(mmu, 0, 0, NULL, NULL);
+        core_mmu_bank_unobserve(mmu, core_vpu_pipe__bank_switched, pipe);
+        core_vpu_destroy(pipe->render);
+        free(pipe->tiles);
+        free(pipe);
+        return 0;
+    }
+
+    *ppipe = pipe;
+    LOGD("core.vpu: drawing on a render thread");
+    return 1;
+}
+
+
+void core_vpu_pipe_stop(struct core_vpu_pipe *pipe)
+{
+    atomic_store(&pipe->quit, 1);
+    pthread_mutex_lock(&pipe->lock);
+    pthread_cond_signal(&pipe->wake);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->thread, NULL);
+
+    core_mmu_write_hook(pipe->vpu->mmu, 0, 0, NULL, NULL);
+    core_mmu_bank_unobserve(pipe->vpu->mmu, core_vpu_pipe__bank_switched,
+            pipe);
+    core_vpu_destroy(pipe->render);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->wake);
+    free(pipe->tiles);
+    free(pipe);
+}
+
+
+/*
+ * Log an event. Writes on the bus land before the VPU's cycle, so they are
+ * seen from the cycle the CPU is in. If the log is full, the render thread is
+ * let run up to the cycles before, which frees every entry but this cycle's.
+ */
+void core_vpu_pipe_log(struct core_vpu_pipe *pipe,
+        enum core_vpu_event_kind kind, uint16_t a, uint8_t v)
+{
+    unsigned int head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+    uint64_t now = pipe->vpu->cpu->total_cycles;
+    struct core_vpu_event *e;
+
+    if(head - atomic_load(&pipe->tail) == VPU_LOG_SZ) {
+        core_vpu_pipe_release(pipe, now - 1);
+        while(head - atomic_load(&pipe->tail) == VPU_LOG_SZ)
+            sched_yield();
+    }
+
+    e = &pipe->log[head & (VPU_LOG_SZ - 1)];
+    e->cycle = now;
+    e->a = a;
+    e->v = v;
+    e->kind = kind;
+    atomic_store_explicit(&pipe->head, head + 1, memory_order_release);
+}
+
+
+/*
+ * Let the render thread run up to cycle t, waking it if it sleeps. The store
+ * and the load are sequentially consistent, so either the thread sees the new
+ * horizon before sleeping, or it is seen to sleep here.
+ */
+void core_vpu_pipe_release(struct core_vpu_pipe *pipe, uint64_t t)
+{
+    if(atomic_load_explicit(&pipe->horizon, memory_order_relaxed) > t)
+        return;
+    atomic_store(&pipe->horizon, t + 1);
+    if(atomic_load(&pipe->sleeping)) {
+        pthread_mutex_lock(&pipe->lock);
+        pthread_cond_signal(&pipe->wake);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+}
+
+
+/* Log CPU writes to the tile bank, which do not go through the VPU. */
+static void core_vpu_pipe__tile_written(void *ctx, uint16_t a, uint8_t v)
+{
+    core_vpu_pipe_log(ctx, VPU_EV_TILE_WRITE, a, v);
+}
+
+
+/*
+ * Log tile bank switches. A bank switched in for the first time has never
+ * been written, so it is copied as it is now, before the render thread can
+ * get to it.
+ */
+static void core_vpu_pipe__bank_switched(void *ctx, enum core_mmu_bank bank,
+        uint8_t index, uint8_t *mem)
+{
+    struct core_vpu_pipe *pipe = ctx;
+
+    if(bank != B_TILE_SWAP)
+        return;
+    if(!pipe->copied[index])
+        core_vpu_pipe__copy_bank(pipe, index, mem);
+    core_vpu_pipe_log(pipe, VPU_EV_BANK, 0, index);
+}
+
+
+static void core_vpu_pipe__copy_bank(struct core_vpu_pipe *pipe, uint8_t index,
+        const uint8_t *mem)
+{
+    memcpy(pipe->tiles + (size_t)index * MMU_TILE_BANK_SZ, mem,
+            MMU_TILE_BANK_SZ);
+    pipe->copied[index] = 1;
+}
+
+
+/*
+ * Wait until there are cycles to run, and return the first which cannot be
+ * run yet in end. Returns 0 once told to quit.
+ */
+static int core_vpu_pipe__wait(struct core_vpu_pipe *pipe, uint64_t *end)
+{
+    for(;;) {
+        *end = atomic_load_explicit(&pipe->horizon, memory_order_acquire);
+        if(*end > pipe->next)
+            return 1;
+        if(atomic_load(&pipe->quit))
+            return 0;
+
+        pthread_mutex_lock(&pipe->lock);
+        atomic_store(&pipe->sleeping, 1);
+        while(atomic_load(&pipe->horizon) <= pipe->next &&
+                !atomic_load(&pipe->quit))
+            pthread_cond_wait(&pipe->wake, &pipe->lock);
+        atomic_store(&pipe->sleeping, 0);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+}
+
+
+/* Apply a logged write or bank switch to the render thread's copies. */
+static void core_vpu_pipe__apply(struct core_vpu_pipe *pipe,
+        const struct core_vpu_event *e)
+{
+    struct core_vpu *r = pipe->render;
+
+    switch(e->kind) {
+        case VPU_EV_WRITE:
+            core_vpu_store(r, e->a, e->v);
+            break;
+        case VPU_EV_TILE_WRITE:
+            if(r->tile_bank != NULL)
+                r->tile_bank[e->a - A_TILE_SWAP] = e->v;
+            break;
+        case VPU_EV_BANK:
+            r->tile_bank = pipe->tiles + (size_t)e->v * MMU_TILE_BANK_SZ;
+            r->tile_bank_num = e->v;
+            break;
+        case VPU_EV_SKIP:
+            /* As core_vpu_debug_skip_to_vblank did. */
+            r->scanline = 240;
+            pipe->next = (1 + e->cycle / VPU_XRES_CYCLES) * VPU_XRES_CYCLES;
+            break;
+    }
+}
+
+
+/*
+ * Read a byte as the VPU's read requests would. Only the tile bank is copied:
+ * VPU memory reads as 0 outside of blanking, which is when the VPU reads, and
+ * the only other reads are for sprites not on the line, which are not drawn.
+ */
+static uint8_t core_vpu_pipe__readb(struct core_vpu_pipe *pipe, uint16_t a)
+{
+    struct core_vpu *r = pipe->render;
+
+    if(a < A_TILE_SWAP || a > A_TILE_SWAP_END || r->tile_bank == NULL)
+        return 0;
+    return r->tile_bank[a - A_TILE_SWAP];
+}
+
+
+/* Read a word as the VPU's read requests would, from the copies. */
+uint16_t core_vpu_pipe_readw(struct core_vpu_pipe *pipe, uint16_t a)
+{
+    return core_vpu_pipe__readb(pipe, a) |
+        core_vpu_pipe__readb(pipe, a + 1) << 8;
+}
+
+
+/*
+ * Run the render thread's instance, cycle by cycle, as far as allowed. Each
+ * cycle is run the way the CPU thread does it: the writes landing on it
+ * first, then the VPU's read request from the cycle before, then the VPU.
+ */
+static void *core_vpu_pipe__main(void *arg)
+{
+    struct core_vpu_pipe *pipe = arg;
+    struct core_vpu *r = pipe->render;
+    unsigned int tail = atomic_load(&pipe->tail);
+    uint64_t end;
+
+    while(core_vpu_pipe__wait(pipe, &end)) {
+        unsigned int head = atomic_load_explicit(&pipe->head,
+                memory_order_acquire);
+        uint64_t t = core_vpu_now_ns();
+
+        while(pipe->next < end) {
+            while(tail != head) {
+                const struct core_vpu_event *e =
+                    &pipe->log[tail & (VPU_LOG_SZ - 1)];
+
+                if(e->cycle > pipe->next)
+                    break;
+                core_vpu_pipe__apply(pipe, e);
+                tail += 1;
+            }
+            if(pipe->next >= end)
+                break;
+
+            if(r->bus_pending) {
+                r->bus_v = core_vpu_pipe_readw(pipe, r->bus_a);
+                r->bus_pending = 0;
+            }
+            core_vpu_cycle(r, pipe->next);
+            pipe->next += 1;
+        }
+        atomic_store_explicit(&pipe->tail, tail, memory_order_release);
+        r->stats_cur.host_ns += core_vpu_now_ns() - t - r->frame_fn_ns;
+        r->frame_fn_ns = 0;
+    }
+    return NULL;
+}
+
@@ -0,0 +1,91 @@
+/*
+ * core/vpu/pipe.h -- VPU render thread (header).
+ *
+ * Declares the log of video memory writes the CPU thread hands to a second
+ * VPU instance, which draws the frames on a thread of its own.
+ *
+ */
+
+#ifndef QPRA_CORE_VPU_PIPE_H
+#define QPRA_CORE_VPU_PIPE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "core/mmu/mmu.h"
+
+/* Entries in the log; a power of two. */
+#define VPU_LOG_SZ          4096
+
+struct core_vpu;
+
+/*
+ * What happened to video memory: a write to VPU memory or to the tile bank,
+ * a tile bank switch (v holding the new bank), or a debugger skip to V-BLANK.
+ */
+enum core_vpu_event_kind {
+    VPU_EV_WRITE, VPU_EV_TILE_WRITE, VPU_EV_BANK, VPU_EV_SKIP
+};
+
+/* A log entry, stamped with the cycle from which the VPU sees it. */
+struct core_vpu_event
+{
+    uint64_t cycle;
+    uint16_t a;
+    uint8_t v;
+    uint8_t kind;
+};
+
+/*
+ * The CPU thread keeps its own VPU instance for timing only: H-SYNC, V-BLANK
+ * and the video interrupt. Writes it lets through are logged, along with
+ * writes to the tile bank and bank switches; at the end of each line, the
+ * cycles run so far are released to the render thread. That replays the log
+ * against its own copies of video memory and of the tile banks, running its
+ * instance cycle by cycle up to there, which draws and hands over the frames.
+ */
+struct core_vpu_pipe
+{
+    struct core_vpu *vpu;
+    struct core_vpu *render;
+    pthread_t thread;
+
+    /* The render thread's copies of VPU memory and of the tile banks. */
+    uint8_t mem[MMU_VPU_MEM_SZ];
+    uint8_t *tiles;
+    int num_banks;
+    /* Tile banks copied so far; the rest were never switched in. */
+    uint8_t copied[256];
+
+    /* The log: written at head by the CPU thread, read at tail. */
+    struct core_vpu_event log[VPU_LOG_SZ];
+    atomic_uint head;
+    atomic_uint tail;
+    /* The first cycle the render thread may not run yet. */
+    _Atomic uint64_t horizon;
+    /* The next cycle the render thread runs. */
+    uint64_t next;
+
+    /* For the render thread to sleep while it has caught up. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int sleeping;
+    atomic_int quit;
+};
+
+/* Start drawing the VPU's frames on a render thread. */
+int core_vpu_pipe_start(struct core_vpu_pipe **, struct core_vpu *);
+/* Stop the render thread, dropping what it has not drawn. */
+void core_vpu_pipe_stop(struct core_vpu_pipe *);
+
+/* Log an event, stamped with the current cycle. */
+void core_vpu_pipe_log(struct core_vpu_pipe *, enum core_vpu_event_kind,
+        uint16_t, uint8_t);
+/* Let the render thread run cycles up to and including the given one. */
+void core_vpu_pipe_release(struct core_vpu_pipe *, uint64_t);
+/* Read a word of video memory as the render thread's instance sees it. */
+uint16_t core_vpu_pipe_readw(struct core_vpu_pipe *, uint16_t);
+
+#endif
+
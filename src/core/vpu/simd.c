@@ -0,0 +1,232 @@
+/*
+ * core/vpu/simd.c -- VPU pixel kernels.
+ *
+ * Kernels working on whole lines of 4-bit pixels: unpacking them, mapping them
+ * through palettes, blending them over each other and expanding them to RGBA.
+ * Portable C versions are always available; on x86, SSE2, SSSE3 and AVX2
+ * versions are picked at runtime when the CPU supports them.
+ *
+ */
+
+#include <stdint.h>
+
+#include "core/vpu/simd.h"
+#include "core/vpu/vpu.h"
+#include "log.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define QPRA_VPU_SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+/* Portable kernels. */
+static void core_vpu_simd__unpack_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    int i;
+
+    for(i = 0; i < n; ++i) {
+        dst[i*2] = src[i] >> 4;
+        dst[i*2 + 1] = src[i] & 0xf;
+    }
+}
+
+static void core_vpu_simd__lookup_c(uint8_t *dst, const uint8_t *src,
+        const uint8_t *map, int n)
+{
+    int i;
+
+    for(i = 0; i < n; ++i)
+        dst[i] = map[src[i]];
+}
+
+static void core_vpu_simd__blend_c(uint8_t *dst, const uint8_t *src,
+        const uint8_t *map, int n)
+{
+    int i;
+
+    for(i = 0; i < n; ++i)
+        if(src[i])
+            dst[i] = map[src[i]];
+}
+
+static void core_vpu_simd__expand_c(struct rgba *dst, const uint8_t *src,
+        const struct rgba *pal, int n)
+{
+    int i;
+
+    for(i = 0; i < n; ++i)
+        dst[i] = pal[src[i]];
+}
+
+
+#ifdef QPRA_VPU_SIMD_X86
+
+/* Split 16 bytes into 32 nibbles, keeping each high nibble first. */
+__attribute__((target("sse2")))
+static void core_vpu_simd__unpack_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+    const __m128i lo4 = _mm_set1_epi8(0x0f);
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), lo4);
+        __m128i lo = _mm_and_si128(v, lo4);
+
+        _mm_storeu_si128((__m128i *)(dst + i*2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst + i*2 + 16),
+                _mm_unpackhi_epi8(hi, lo));
+    }
+    core_vpu_simd__unpack_c(dst + i*2, src + i, n - i);
+}
+
+/* The 16-entry maps fit a register, so a byte shuffle does 16 lookups. */
+__attribute__((target("ssse3")))
+static void core_vpu_simd__lookup_ssse3(uint8_t *dst, const uint8_t *src,
+        const uint8_t *map, int n)
+{
+    const __m128i m = _mm_loadu_si128((const __m128i *)map);
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(m, s));
+    }
+    core_vpu_simd__lookup_c(dst + i, src + i, map, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void core_vpu_simd__blend_ssse3(uint8_t *dst, const uint8_t *src,
+        const uint8_t *map, int n)
+{
+    const __m128i m = _mm_loadu_si128((const __m128i *)map);
+    const __m128i zero = _mm_setzero_si128();
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i clear = _mm_cmpeq_epi8(s, zero);
+        __m128i v = _mm_shuffle_epi8(m, s);
+
+        v = _mm_or_si128(_mm_and_si128(clear, d), _mm_andnot_si128(clear, v));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    core_vpu_simd__blend_c(dst + i, src + i, map, n - i);
+}
+
+/* Widen each byte to a word holding its two nibbles, high one first. */
+__attribute__((target("avx2")))
+static void core_vpu_simd__unpack_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+    const __m256i lo4 = _mm256_set1_epi16(0x0f);
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(src + i)));
+        __m256i hi = _mm256_srli_epi16(v, 4);
+        __m256i lo = _mm256_slli_epi16(_mm256_and_si256(v, lo4), 8);
+
+        _mm256_storeu_si256((__m256i *)(dst + i*2), _mm256_or_si256(hi, lo));
+    }
+    core_vpu_simd__unpack_c(dst + i*2, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void core_vpu_simd__lookup_avx2(uint8_t *dst, const uint8_t *src,
+        const uint8_t *map, int n)
+{
+    const __m256i m = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)map));
+    int i;
+
+    for(i = 0; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(m, s));
+    }
+    core_vpu_simd__lookup_ssse3(dst + i, src + i, map, n - i);
+}
+
+__attribute__((target("avx2")))
+static void core_vpu_simd__blend_avx2(uint8_t *dst, const uint8_t *src,
+        const uint8_t *map, int n)
+{
+    const __m256i m = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)map));
+    const __m256i zero = _mm256_setzero_si256();
+    int i;
+
+    for(i = 0; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i clear = _mm256_cmpeq_epi8(s, zero);
+
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                _mm256_blendv_epi8(_mm256_shuffle_epi8(m, s), d, clear));
+    }
+    core_vpu_simd__blend_ssse3(dst + i, src + i, map, n - i);
+}
+
+/* The fixed palette has 256 entries, too many to shuffle; gather instead. */
+__attribute__((target("avx2")))
+static void core_vpu_simd__expand_avx2(struct rgba *dst, const uint8_t *src,
+        const struct rgba *pal, int n)
+{
+    int i;
+
+    for(i = 0; i + 8 <= n; i += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i *)(src + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                _mm256_i32gather_epi32((const int *)pal, idx, 4));
+    }
+    core_vpu_simd__expand_c(dst + i, src + i, pal, n - i);
+}
+
+#endif
+
+
+static const struct core_vpu_simd core_vpu_simd__c = {
+    "C", core_vpu_simd__unpack_c, core_vpu_simd__lookup_c,
+    core_vpu_simd__blend_c, core_vpu_simd__expand_c
+};
+
+#ifdef QPRA_VPU_SIMD_X86
+static const struct core_vpu_simd core_vpu_simd__sse2 = {
+    "SSE2", core_vpu_simd__unpack_sse2, core_vpu_simd__lookup_c,
+    core_vpu_simd__blend_c, core_vpu_simd__expand_c
+};
+
+static const struct core_vpu_simd core_vpu_simd__ssse3 = {
+    "SSSE3", core_vpu_simd__unpack_sse2, core_vpu_simd__lookup_ssse3,
+    core_vpu_simd__blend_ssse3, core_vpu_simd__expand_c
+};
+
+static const struct core_vpu_simd core_vpu_simd__avx2 = {
+    "AVX2", core_vpu_simd__unpack_avx2, core_vpu_simd__lookup_avx2,
+    core_vpu_simd__blend_avx2, core_vpu_simd__expand_avx2
+};
+#endif
+
+
+/* Pick the best kernels for the host CPU, not going above max. */
+const struct core_vpu_simd *core_vpu_simd_select(enum core_vpu_simd_level max)
+{
+    const struct core_vpu_simd *k = &core_vpu_simd__c;
+
+#ifdef QPRA_VPU_SIMD_X86
+    __builtin_cpu_init();
+    if(max >= VPU_SIMD_AVX2 && __builtin_cpu_supports("avx2"))
+        k = &core_vpu_simd__avx2;
+    else if(max >= VPU_SIMD_SSSE3 && __builtin_cpu_supports("ssse3"))
+        k = &core_vpu_simd__ssse3;
+    else if(max >= VPU_SIMD_SSE2 && __builtin_cpu_supports("sse2"))
+        k = &core_vpu_simd__sse2;
+#endif
+
+    LOGD("core.vpu: using %s pixel kernels", k->name);
+    return k;
+}
+
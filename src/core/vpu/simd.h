@@ -0,0 +1,44 @@
+/*
+ * core/vpu/simd.h -- VPU pixel kernels (header).
+ *
+ * Declares the table of kernels the scanline renderer uses to work on whole
+ * lines of 4-bit pixels at once, and the function picking the best ones the
+ * host CPU supports.
+ *
+ */
+
+#ifndef QPRA_CORE_VPU_SIMD_H
+#define QPRA_CORE_VPU_SIMD_H
+
+#include <stdint.h>
+
+struct rgba;
+
+/* Instruction set levels, from the portable C kernels upwards. */
+enum core_vpu_simd_level {
+    VPU_SIMD_NONE, VPU_SIMD_SSE2, VPU_SIMD_SSSE3, VPU_SIMD_AVX2
+};
+
+/*
+ * Line kernels. Pixel indices are 4-bit palette entries, one per byte; maps
+ * are 16-entry tables from those to fixed palette entries.
+ */
+struct core_vpu_simd
+{
+    const char *name;
+
+    /* Unpack n bytes of packed pixels into 2n indices, high nibble first. */
+    void (*unpack)(uint8_t *, const uint8_t *, int);
+    /* Map n indices through a 16-entry table. */
+    void (*lookup)(uint8_t *, const uint8_t *, const uint8_t *, int);
+    /* The same, over the destination: index 0 is transparent. */
+    void (*blend)(uint8_t *, const uint8_t *, const uint8_t *, int);
+    /* Expand n fixed palette entries to RGBA. */
+    void (*expand)(struct rgba *, const uint8_t *, const struct rgba *, int);
+};
+
+/* Return the kernels for the best level supported, up to the given one. */
+const struct core_vpu_simd *core_vpu_simd_select(enum core_vpu_simd_level);
+
+#endif
+
@@ -0,0 +1,122 @@
+/*
+ * core/vpu/tiles.c -- VPU tile cache.
+ *
+ * Keeps the tile banks expanded to one pixel index per byte. The MMU's dirty
+ * page tracking says which pages of the banks were written, and the tiles in
+ * them are expanded again when they are next used.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/vpu/tiles.h"
+#include "core/mmu/mmu.h"
+#include "log.h"
+
+/* Tiles in each page the MMU tracks. */
+#define VPU_PAGE_TILES      (MMU_PAGE_SZ / 32)
+#define VPU_BANK_PAGES      (MMU_TILE_BANK_SZ / MMU_PAGE_SZ)
+
+
+/* Start tracking writes to the tile banks. No bank is expanded yet. */
+int core_vpu_tiles_init(struct core_vpu_tiles **ptiles, struct core_mmu *mmu)
+{
+    struct core_vpu_tiles *tiles;
+    size_t num;
+
+    *ptiles = NULL;
+    tiles = calloc(1, sizeof(struct core_vpu_tiles));
+    if(tiles == NULL) {
+        LOGE("Could not allocate the tile cache");
+        return 0;
+    }
+    tiles->mmu = mmu;
+    tiles->num_banks = mmu->tile_s_total;
+
+    num = (size_t)tiles->num_banks * VPU_BANK_PAGES;
+    tiles->pages = calloc((num + 63) / 64, sizeof(uint64_t));
+    tiles->dirty = core_mmu_dirty_register(mmu, mmu->arena.tile_s,
+            (size_t)tiles->num_banks * MMU_TILE_BANK_SZ);
+    if(tiles->pages == NULL || tiles->dirty < 0) {
+        LOGE("Could not track writes to the tile banks");
+        core_vpu_tiles_destroy(tiles);
+        return 0;
+    }
+
+    *ptiles = tiles;
+    return 1;
+}
+
+
+void core_vpu_tiles_destroy(struct core_vpu_tiles *tiles)
+{
+    int i;
+
+    if(tiles == NULL)
+        return;
+    for(i = 0; i < 256; ++i)
+        free(tiles->banks[i]);
+    free(tiles->pages);
+    free(tiles);
+}
+
+
+/* Mark the tiles in the pages written since the last call as stale. */
+size_t core_vpu_tiles_sync(struct core_vpu_tiles *tiles, uint8_t bank)
+{
+    size_t i, n = 0, num = (size_t)tiles->num_banks * VPU_BANK_PAGES;
+    uint64_t mask = ((uint64_t)1 << VPU_PAGE_TILES) - 1;
+
+    if(core_mmu_dirty_get(tiles->mmu, tiles->dirty, tiles->pages) == 0)
+        return 0;
+
+    for(i = 0; i < num; ++i) {
+        struct core_vpu_tile_bank *tb = tiles->banks[i / VPU_BANK_PAGES];
+        size_t t = (i % VPU_BANK_PAGES) * VPU_PAGE_TILES;
+
+        if(!(tiles->pages[i >> 6] & ((uint64_t)1 << (i & 63))))
+            continue;
+        if(i / VPU_BANK_PAGES == bank)
+            n += 1;
+        if(tb != NULL)
+            tb->stale[t >> 6] |= mask << (t & 63);
+    }
+    return n;
+}
+
+
+/* Return a bank's cache, every tile stale until first used. */
+struct core_vpu_tile_bank *core_vpu_tiles_bank(struct core_vpu_tiles *tiles,
+        uint8_t bank)
+{
+    struct core_vpu_tile_bank *tb = tiles->banks[bank];
+
+    if(tb == NULL) {
+        tb = malloc(sizeof(struct core_vpu_tile_bank));
+        if(tb == NULL) {
+            LOGE("Could not allocate the cache of tile bank %d", bank);
+            return NULL;
+        }
+        memset(tb->stale, 0xff, sizeof(tb->stale));
+        tiles->banks[bank] = tb;
+    }
+    return tb;
+}
+
+
+/* Expand a tile's 32 bytes to 64 indices. */
+void core_vpu_tiles_expand(struct core_vpu_tile_bank *tb, const uint8_t *mem,
+        int t)
+{
+    const uint8_t *src = mem + t*32;
+    uint8_t *dst = tb->px + t*64;
+    int i;
+
+    for(i = 0; i < 32; ++i) {
+        dst[i*2] = src[i] >> 4;
+        dst[i*2 + 1] = src[i] & 0xf;
+    }
+    tb->stale[t >> 6] &= ~((uint64_t)1 << (t & 63));
+}
+
@@ -0,0 +1,76 @@
+/*
+ * core/vpu/tiles.h -- VPU tile cache (header).
+ *
+ * Declares the cache of tile banks expanded to one 4-bit pixel index per byte,
+ * which the scanline renderer copies rows from instead of unpacking them.
+ *
+ */
+
+#ifndef QPRA_CORE_VPU_TILES_H
+#define QPRA_CORE_VPU_TILES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "core/mmu/mmu.h"
+
+#define VPU_BANK_TILES      (MMU_TILE_BANK_SZ / 32)
+
+/*
+ * One tile bank, expanded: two indices for each byte, high nibble first. Tiles
+ * whose bytes were written since they were expanded are marked stale, and are
+ * expanded again the next time one of their rows is asked for.
+ */
+struct core_vpu_tile_bank
+{
+    uint64_t stale[VPU_BANK_TILES / 64];
+    uint8_t px[MMU_TILE_BANK_SZ * 2];
+};
+
+/* The cache of every tile bank in use, allocated the first time it is. */
+struct core_vpu_tiles
+{
+    struct core_mmu *mmu;
+
+    /* The MMU's dirty tracking over the tile banks, and a bitmap for it. */
+    int dirty;
+    uint64_t *pages;
+    int num_banks;
+
+    struct core_vpu_tile_bank *banks[256];
+};
+
+int core_vpu_tiles_init(struct core_vpu_tiles **, struct core_mmu *);
+void core_vpu_tiles_destroy(struct core_vpu_tiles *);
+
+/*
+ * Mark the tiles written since the last call as stale. Returns how many pages
+ * of the given bank were written.
+ */
+size_t core_vpu_tiles_sync(struct core_vpu_tiles *, uint8_t);
+
+/* Return the cache of a bank, allocating it if needed; NULL if that fails. */
+struct core_vpu_tile_bank *core_vpu_tiles_bank(struct core_vpu_tiles *,
+        uint8_t);
+
+/* Expand a tile of a bank, whose contents are at mem, again. */
+void core_vpu_tiles_expand(struct core_vpu_tile_bank *, const uint8_t *, int);
+
+/*
+ * Return the 8 indices for bytes [offs, offs + 4) of a bank, whose contents
+ * are at mem. The bytes may cross into the next tile.
+ */
+static inline const uint8_t *core_vpu_tiles_row(struct core_vpu_tile_bank *tb,
+        const uint8_t *mem, unsigned int offs)
+{
+    int t0 = offs >> 5, t1 = (offs + 3) >> 5;
+
+    if(tb->stale[t0 >> 6] & ((uint64_t)1 << (t0 & 63)))
+        core_vpu_tiles_expand(tb, mem, t0);
+    if(tb->stale[t1 >> 6] & ((uint64_t)1 << (t1 & 63)))
+        core_vpu_tiles_expand(tb, mem, t1);
+    return tb->px + offs*2;
+}
+
+#endif
+
@@ -8,8 +8,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "core/vpu/vpu.h"
+#include "core/vpu/simd.h"
+#include "core/vpu/tiles.h"
+#include "core/vpu/pipe.h"
 #include "core/cpu/cpu.h"
 #include "core/mmu/mmu.h"
 #include "ui/ui.h"
@@ -78,11 +82,35 @@ static inline int core_vpu__spr_tile(struct core_vpu_sprite spr) {
 }
 
 
+static void core_vpu__map_mem(struct core_vpu *, uint8_t *);
+static void core_vpu__bank_switched(void *, enum core_mmu_bank, uint8_t,
+        uint8_t *);
+static void core_vpu__decode_sprite(struct core_vpu *, int);
+static void core_vpu__place_group(struct core_vpu *, int);
 static void core_vpu__fetch_data(struct core_vpu *, int, int);
+static void core_vpu__fetch_block(struct core_vpu *, unsigned int);
+static void core_vpu__latch_rows(struct core_vpu *, unsigned int);
+static struct core_vpu_tile_bank *core_vpu__tiles_ready(struct core_vpu *);
+static void core_vpu__layer_rows(struct core_vpu_tile_bank *, const uint8_t *,
+        const uint16_t *, uint8_t *);
+static int core_vpu__l2_entry(struct core_vpu *, int);
+static int core_vpu__l1_entry(struct core_vpu *, int);
+static int core_vpu__spr_entry(struct core_vpu *, int, int);
 static struct rgba core_vpu__get_l2px(struct core_vpu *, int, int);
 static struct rgba core_vpu__get_l1px(struct core_vpu *, int, int, struct rgba);
 static struct rgba core_vpu__get_spx(struct core_vpu *, int, int, int, struct rgba);
+static void core_vpu__update_pals(struct core_vpu *);
+static void core_vpu__eval_sprites(struct core_vpu *, int);
+static struct rgba core_vpu__get_sprites_px(struct core_vpu *, int, int,
+        struct rgba);
+static uint16_t core_vpu__get_ix(struct core_vpu *, int, int);
 static void core_vpu__write_px(struct core_vpu *, int, int, struct rgba);
+static void core_vpu__render_line(struct core_vpu *, int);
+static uint64_t core_vpu__hash(uint64_t, const void *, size_t);
+static void core_vpu__damage(struct core_vpu *);
+static void core_vpu__stats_line(struct core_vpu *);
+static void core_vpu__stats_frame(struct core_vpu *);
+static void core_vpu__stats_read(struct core_vpu *, struct core_vpu_stats *);
 
 /* 
  * Initialize the VPU state. This includes allocating the struct, and setting
@@ -104,12 +132,93 @@ int core_vpu_init(struct core_vpu **pvpu, struct core_cpu *cpu)
     vpu->mmu = cpu->mmu;
     
     vpu->tile_bank = vpu->mmu->tile_s;
+    vpu->tile_bank_num = vpu->mmu->tile_bank;
+    if(!core_vpu_tiles_init(&vpu->tiles, vpu->mmu))
+        return 0;
+    vpu->simd = core_vpu_simd_select(VPU_SIMD_AVX2);
+    vpu->draw_every = 1;
+    /* With lazy sync, the VPU has caught up to wherever the CPU starts. */
+    vpu->cycle = vpu->deadline = cpu->total_cycles;
+    if(!core_mmu_bank_observe(vpu->mmu, core_vpu__bank_switched, vpu))
+        return 0;
+
+    /* Video memory and the framebuffer live in the MMU's arena. */
+    core_vpu__map_mem(vpu, vpu->mmu->arena.base + vpu->mmu->arena.vpu_mem);
+    vpu->fb_index = ui_fb_attach(vpu->mmu->arena.base + vpu->mmu->arena.vpu_fb);
+    vpu->rgba_fb = vpu->mmu->arena.base + vpu->mmu->arena.vpu_fb +
+        (size_t)vpu->fb_index * MMU_VPU_FB_SZ;
+
+    return 1;
+}
+
 
-    vpu->mem = malloc(3*1024);
-    if(vpu->mem == NULL) {
-        LOGE("Could not allocate video memory space; exiting");
+/*
+ * Set up a VPU instance drawing what vpu does, but from its own copy of VPU
+ * memory at mem, for the render thread. It starts at the same point as vpu,
+ * into the same framebuffer, and without a tile cache: the MMU only tracks
+ * writes to the tile banks themselves.
+ */
+int core_vpu_init_replica(struct core_vpu **pvpu, struct core_vpu *vpu,
+        uint8_t *mem)
+{
+    struct core_vpu *r;
+
+    *pvpu = r = calloc(1, sizeof(struct core_vpu));
+    if(r == NULL) {
+        LOGE("Could not allocate the render thread's vpu core");
         return 0;
     }
+    r->cpu = vpu->cpu;
+    r->mmu = vpu->mmu;
+    r->replica = 1;
+    r->renderer = vpu->renderer;
+    r->simd = vpu->simd;
+    r->output = vpu->output;
+    r->fetch = vpu->fetch;
+    r->draw_every = vpu->draw_every;
+    r->draw_count = vpu->draw_count;
+    r->skipping = vpu->skipping;
+    r->scanline = vpu->scanline;
+    r->tile_bank_num = vpu->tile_bank_num;
+    r->frame_fn = vpu->frame_fn;
+    r->frame_ctx = vpu->frame_ctx;
+
+    core_vpu__map_mem(r, mem);
+    r->fb_index = vpu->fb_index;
+    r->rgba_fb = vpu->rgba_fb;
+    return 1;
+}
+
+
+/* Free all memory allocated by the VPU. Its buffers belong to the MMU. */
+int core_vpu_destroy(struct core_vpu *vpu)
+{
+    if(vpu->pipe != NULL && !vpu->replica)
+        core_vpu_pipe_stop(vpu->pipe);
+    core_vpu_tiles_destroy(vpu->tiles);
+    free(vpu);
+    return 1;
+}
+
+
+/*
+ * Draw the frames on a render thread from now on, leaving this instance to
+ * keep time for the CPU.
+ */
+int core_vpu_thread(struct core_vpu *vpu)
+{
+    if(vpu->pipe != NULL)
+        return 1;
+    return core_vpu_pipe_start(&vpu->pipe, vpu);
+}
+
+
+/* Point the VPU's registers and tables into its memory, and start drawing. */
+static void core_vpu__map_mem(struct core_vpu *vpu, uint8_t *mem)
+{
+    int i;
+
+    vpu->mem = mem;
     vpu->layer1_tm = (uint8_t (*)[VPU_TILEMAP_SIZE])vpu->mem;
     vpu->layer2_tm = (uint8_t (*)[VPU_TILEMAP_SIZE])(vpu->mem + 0x480);
     vpu->pals = (uint8_t (*)[VPU_PALETTE_NUM*VPU_PALETTE_SZ])(vpu->mem + 0x900);
@@ -127,8 +236,6 @@ int core_vpu_init(struct core_vpu **pvpu, struct core_cpu *cpu)
     vpu->layer2_fsy = vpu->mem + 0xb89;
     vpu->tile_s_bank = vpu->mem + 0xb90;
 
-    vpu->rgba_fb = malloc(VPU_XRES * VPU_YRES * 4);
-
     vpu->sl__l1data_r = vpu->sl__l1data[0];
     vpu->sl__l2data_r = vpu->sl__l2data[0];
     vpu->sl__sdata_r = vpu->sl__sdata[0];
@@ -136,17 +243,58 @@ int core_vpu_init(struct core_vpu **pvpu, struct core_cpu *cpu)
     vpu->sl__l1data_w = vpu->sl__l1data[1];
     vpu->sl__l2data_w = vpu->sl__l2data[1];
     vpu->sl__sdata_w = vpu->sl__sdata[1];
+    vpu->sl__rows_r = vpu->sl__rows[0];
+    vpu->sl__rows_w = vpu->sl__rows[1];
+    vpu->sl__tiles_stale = 2;
+
+    memset(&vpu->spr, 0, sizeof(vpu->spr));
+    for(i = 0; i < VPU_NUM_SPRITES; ++i)
+        core_vpu__decode_sprite(vpu, i);
+    vpu->pal_dirty = ~0u;
+    core_vpu__update_pals(vpu);
+    vpu->stats_cur.sprites_min = ~0u;
+}
 
-    return 1;
+
+/* Decode a sprite's attributes, moving it to its group's members. */
+static void core_vpu__decode_sprite(struct core_vpu *vpu, int i)
+{
+    struct core_vpu_sprites *t = &vpu->spr;
+    struct core_vpu_sprite spr = *(struct core_vpu_sprite *)&(*vpu->spr_ctl)[i*4];
+    int g = core_vpu__spr_group(spr);
+
+    t->members[t->group[i]] &= ~((uint64_t)1 << i);
+    t->members[g] |= (uint64_t)1 << i;
+    t->group[i] = g;
+
+    t->enabled[i] = core_vpu__spr_enabled(spr);
+    t->depth[i] = core_vpu__spr_depth(spr);
+    t->hmirror[i] = core_vpu__spr_hmirror(spr);
+    t->vmirror[i] = core_vpu__spr_vmirror(spr);
+    t->hdouble[i] = core_vpu__spr_hdouble(spr);
+    t->vdouble[i] = core_vpu__spr_vdouble(spr);
+    t->w[i] = t->hdouble[i] ? 16 : 8;
+    t->h[i] = t->vdouble[i] ? 16 : 8;
+    t->tile[i] = core_vpu__spr_tile(spr);
+    t->x[i] = (*vpu->grp_pos)[g*2] + core_vpu__spr_xoffs(spr);
+    t->y[i] = (*vpu->grp_pos)[g*2 + 1] + core_vpu__spr_yoffs(spr);
 }
 
 
-/* Free all memory allocated by the VPU. */
-int core_vpu_destroy(struct core_vpu *vpu)
+/* Move a group's sprites along with it. */
+static void core_vpu__place_group(struct core_vpu *vpu, int g)
 {
-    free(vpu->rgba_fb);
-    free(vpu->mem);
-    free(vpu);
+    uint64_t m = vpu->spr.members[g];
+
+    while(m != 0) {
+        int i = __builtin_ctzll(m);
+        struct core_vpu_sprite spr =
+            *(struct core_vpu_sprite *)&(*vpu->spr_ctl)[i*4];
+
+        vpu->spr.x[i] = (*vpu->grp_pos)[g*2] + core_vpu__spr_xoffs(spr);
+        vpu->spr.y[i] = (*vpu->grp_pos)[g*2 + 1] + core_vpu__spr_yoffs(spr);
+        m &= m - 1;
+    }
 }
 
 /* Copy the default palette into the VPU's private memory. */
@@ -162,16 +310,28 @@ int core_vpu_init_palette(struct core_vpu *vpu, uint8_t *palette)
         LOGV("palette entry %02x: %02x %02x %02x", i, pal_fixed[i].r, pal_fixed[i].g, pal_fixed[i].b);
         pal_fixed[i].a = 255; 
     }
+    /* Every row was drawn with the old colours. */
+    memset(vpu->sl__hash_ok, 0, sizeof(vpu->sl__hash_ok));
+    memset(vpu->sl__frame_ok, 0, sizeof(vpu->sl__frame_ok));
+    vpu->pal_dirty = ~0u;
+    core_vpu__update_pals(vpu);
 
     return 1;
 }
 
 
-/* Perform a per-frame state update of the VPU. */
-void core_vpu_update(struct core_vpu *vpu)
+/* Follow the MMU's bank switches: a new tile bank may have been switched in. */
+static void core_vpu__bank_switched(void *ctx, enum core_mmu_bank bank,
+        uint8_t index, uint8_t *mem)
 {
-    /* A new tile bank may have been switched in; point to the right one. */
-    vpu->tile_bank = vpu->cpu->mmu->tile_s;
+    struct core_vpu *vpu = ctx;
+
+    if(bank == B_TILE_SWAP) {
+        vpu->tile_bank = mem;
+        vpu->tile_bank_num = index;
+        /* Rows already read came from the other bank. */
+        vpu->sl__tiles_stale = 2;
+    }
 }
 
 
@@ -378,16 +538,62 @@ void core_vpu_write_fb(struct core_vpu *vpu)
 }
 #endif
 
-static int scanline = 0;
-
 /*
  * Debug function to begin vblank at an arbitrary time, by messing with the
  * scanline and cycle counters.
  */
 int core_vpu_debug_skip_to_vblank(struct core_vpu *vpu, int total_cycles)
 {
-   scanline = 240;
-   return (1 + total_cycles / VPU_XRES_CYCLES) * (VPU_XRES_CYCLES);
+   int next = (1 + total_cycles / VPU_XRES_CYCLES) * (VPU_XRES_CYCLES);
+
+   core_vpu_sync(vpu, total_cycles);
+   vpu->scanline = 240;
+   vpu->cycle = vpu->deadline = next;
+   if(vpu->pipe != NULL)
+       core_vpu_pipe_log(vpu->pipe, VPU_EV_SKIP, 0, 0);
+   return next;
+}
+
+
+/* Whether this instance draws: not so for the CPU's, with a render thread. */
+static inline int core_vpu__draws(struct core_vpu *vpu)
+{
+    return vpu->pipe == NULL || vpu->replica;
+}
+
+
+/*
+ * The host clock, for timing an instance's own work; the render thread's is
+ * timed as a whole, by the thread.
+ */
+static inline uint64_t core_vpu__clock(struct core_vpu *vpu)
+{
+    return vpu->replica ? 0 : core_vpu_now_ns();
+}
+
+
+/*
+ * Place a read request for the tile data at a on the bus, or hold it for the
+ * render thread or the catch-up to serve.
+ */
+static inline void core_vpu__send(struct core_vpu *vpu, uint16_t a)
+{
+    vpu->stats_cur.fetches += 1;
+    if(vpu->replica || vpu->sync == VPU_SYNC_LAZY) {
+        vpu->bus_pending = 1;
+        vpu->bus_a = a;
+    } else {
+        core_mmu_rw_send_vpu(vpu->mmu, a);
+    }
+}
+
+
+/* Return the result of the last read request. */
+static inline uint16_t core_vpu__fetch(struct core_vpu *vpu)
+{
+    if(vpu->replica || vpu->sync == VPU_SYNC_LAZY)
+        return vpu->bus_v;
+    return core_mmu_rw_fetch_vpu(vpu->mmu);
 }
 
 /* 
@@ -401,10 +607,9 @@ int core_vpu_debug_skip_to_vblank(struct core_vpu *vpu, int total_cycles)
 void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
 {
     uint8_t *temp;
+    uint16_t *rows;
     int c = total_cycles % VPU_XRES_CYCLES;
-
-    /* First, update state if necessary. */
-    core_vpu_update(vpu);
+    int scanline = vpu->scanline;
 
     vpu->hsync = (c < 25);
 
@@ -413,7 +618,8 @@ void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
 
     /* Scanlines 0-11 and 240 - 261 are V-BLANK lines. We do nothing there.
      * Otherwise, we are in pre-render or render lines. */
-    else if(scanline >= 15 && scanline < 240) {
+    else if(scanline >= 15 && scanline < 240 && core_vpu__draws(vpu) &&
+            !vpu->skipping) {
 
         core_vpu__fetch_data(vpu, scanline, c);
 
@@ -421,38 +627,38 @@ void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
             /* Cycles 0-24: H-SYNC. */
             /* Cycles 25-64: Back porch and colorburst. */
     
+            /* Find the palettes and sprites for this line, before its first
+             * pixel. */
+            if(c == 65) {
+                core_vpu__update_pals(vpu);
+                core_vpu__eval_sprites(vpu, scanline);
+            }
+
             /* Cycles 65-320: Pixel data! */
-            if(c >= 65 && c < 321) {
-                struct rgba out, l1, l2, s[VPU_NUM_SPRITES] = {0};
-                int i, l1t, st[VPU_NUM_SPRITES] = {0};
-                int x = c - 65;
+            if(c >= 65 && c < 321 && vpu->renderer == VPU_RENDER_CYCLE &&
+                    vpu->output == VPU_OUTPUT_INDEXED) {
+                uint16_t *fb = (uint16_t *) vpu->rgba_fb;
+                fb[(scanline - 16)*VPU_XRES + c - 65] =
+                    core_vpu__get_ix(vpu, scanline, c);
+            } else if(c >= 65 && c < 321 && vpu->renderer == VPU_RENDER_CYCLE) {
+                struct rgba out;
                 
                 /* Get RGB and transparency data for each layer and sprite's
                  * pixel. */
                 out = core_vpu__get_l2px(vpu, scanline, c);
                 out = core_vpu__get_l1px(vpu, scanline, c, out);
-                for(i = 0; i < VPU_NUM_SPRITES; ++i) {
-                    struct core_vpu_sprite spr = *(struct core_vpu_sprite *)&(*vpu->spr_ctl)[i*4];
-                    if (!core_vpu__spr_enabled(spr))
-                        continue;
-                    int hdouble = core_vpu__spr_hdouble(spr);
-                    int vdouble = core_vpu__spr_vdouble(spr);
-                    uint8_t grp = core_vpu__spr_group(spr);
-                    int startx = (*vpu->grp_pos)[grp*2] + core_vpu__spr_xoffs(spr);
-                    int endx = startx + (hdouble ? 16 : 8);
-                    int starty = (*vpu->grp_pos)[grp*2 + 1] + core_vpu__spr_yoffs(spr);
-                    int endy = starty + (vdouble ? 16 : 8);
-                    if((x >= startx) &&
-                       (x < endx) &&
-                       ((scanline-16) >= starty) &&
-                       ((scanline-16) < endy)) {
-                        out = core_vpu__get_spx(vpu, scanline, c, i, out);
-                    }
-                }
+                out = core_vpu__get_sprites_px(vpu, scanline, c, out);
     
                 /* Finally, output the pixel to the framebuffer. */
                 core_vpu__write_px(vpu, scanline, c, out);
+            } else if(c == 320 && vpu->renderer == VPU_RENDER_SCANLINE) {
+                /* The whole line at once, at the end of its pixel data. */
+                uint64_t t = core_vpu__clock(vpu);
+                core_vpu__render_line(vpu, scanline);
+                vpu->stats_cur.host_ns += core_vpu__clock(vpu) - t;
             }
+            if(c == 320 && vpu->renderer == VPU_RENDER_CYCLE)
+                core_vpu__stats_line(vpu);
         }
 
     } else if(scanline == 240 && c == 0) {
@@ -462,7 +668,7 @@ void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
     /* The last cycle of the scanline is a good time to increment
      * the scanline counter, and wrap it if necessary! */
     if(c == 340) {
-        scanline = (scanline + 1) % VPU_YRES_SCANLINES;
+        scanline = vpu->scanline = (scanline + 1) % VPU_YRES_SCANLINES;
         /* XXX: this might be a good place to implement the double
          * buffering's framebuffer swap. */
         if(scanline == 0) {
@@ -479,10 +685,64 @@ void core_vpu_cycle(struct core_vpu *vpu, int total_cycles)
         temp = vpu->sl__sdata_r;
         vpu->sl__sdata_r = vpu->sl__sdata_w;
         vpu->sl__sdata_w = temp;
+        rows = vpu->sl__rows_r;
+        vpu->sl__rows_r = vpu->sl__rows_w;
+        vpu->sl__rows_w = rows;
+
+        /* Everything the render thread needs for this line is logged. */
+        if(!core_vpu__draws(vpu))
+            core_vpu_pipe_release(vpu->pipe, total_cycles);
     }
 }
 
 
+/*
+ * Catch the VPU up to cycle t, running each cycle before it, for lazy sync.
+ * Its read requests are served as the bus would, after the CPU's, from memory
+ * as it is: nothing it reads can have changed without catching it up first.
+ * Lines with nothing to fetch or draw only count their cycles, up to the last.
+ */
+void core_vpu_sync(struct core_vpu *vpu, uint64_t t)
+{
+    uint64_t end;
+    int c, lines;
+
+    if(vpu->sync != VPU_SYNC_LAZY || vpu->cycle >= t)
+        return;
+    while(vpu->cycle < t) {
+        if(vpu->bus_pending) {
+            vpu->bus_v = core_mmu_rw_vpu(vpu->mmu, vpu->bus_a);
+            vpu->bus_pending = 0;
+        }
+        c = vpu->cycle % VPU_XRES_CYCLES;
+        if(c > 0 && c < VPU_XRES_CYCLES - 1 && (vpu->scanline < 15 ||
+                    vpu->scanline >= 240 || !core_vpu__draws(vpu) ||
+                    vpu->skipping)) {
+            end = vpu->cycle + (VPU_XRES_CYCLES - 1 - c);
+            vpu->cycle = end < t ? end : t;
+            vpu->hsync = (vpu->cycle - 1) % VPU_XRES_CYCLES < 25;
+            continue;
+        }
+        core_vpu_cycle(vpu, vpu->cycle);
+        vpu->cycle += 1;
+    }
+
+    /*
+     * Next due is the start of V-BLANK, which raises the interrupt; or with a
+     * render thread, the end of the line, which lets it draw the line.
+     */
+    c = vpu->cycle % VPU_XRES_CYCLES;
+    if(!core_vpu__draws(vpu)) {
+        vpu->deadline = vpu->cycle + (VPU_XRES_CYCLES - 1 - c);
+        return;
+    }
+    lines = (240 - vpu->scanline + VPU_YRES_SCANLINES) % VPU_YRES_SCANLINES;
+    if(lines == 0 && c > 0)
+        lines = VPU_YRES_SCANLINES;
+    vpu->deadline = vpu->cycle + lines*VPU_XRES_CYCLES - c;
+}
+
+
 /* Makes the correct memory accesses for a given scanline and cycle. */
 static void core_vpu__fetch_data(struct core_vpu *vpu, int scanline, int c)
 {
@@ -499,6 +759,18 @@ static void core_vpu__fetch_data(struct core_vpu *vpu, int scanline, int c)
     if(c < 25)
         return;
 
+    /* Or it reads the whole line's data at once, where the last read lands. */
+    if(vpu->fetch == VPU_FETCH_BLOCK) {
+        if(a == 256) {
+            uint64_t t = core_vpu__clock(vpu);
+            core_vpu__fetch_block(vpu, y);
+            vpu->stats_cur.host_ns += core_vpu__clock(vpu) - t;
+            if(vpu->renderer == VPU_RENDER_SCANLINE)
+                core_vpu__latch_rows(vpu, y);
+        }
+        return;
+    }
+
     /* For "regular" scanlines, the following reads are performed:
      * - layer 1 tile data (4*32 = 128 bytes; 64 reads)
      * - layer 2 tile data (4*32 = 128 bytes; 64 reads)
@@ -508,98 +780,529 @@ static void core_vpu__fetch_data(struct core_vpu *vpu, int scanline, int c)
     if(a < 64) {
         /* At cycle 0, there is no previous read request to read back. */
         if(a > 0)
-            *(uint16_t *)&vpu->sl__l1data_w[(a - 1)*2] = core_mmu_rw_fetch_vpu(vpu->mmu);
+            *(uint16_t *)&vpu->sl__l1data_w[(a - 1)*2] = core_vpu__fetch(vpu);
         /* Fetch the tile data for tile[y][x], where:
          * - y = (scanline - 12) / 8 (tiles are 8 scanlines tall)
          * - x = (c - 25) / (8/2) (tiles are 4 BYTES wide) */
-        core_mmu_rw_send_vpu(vpu->mmu,
+        core_vpu__send(vpu,
                 (VPU_A_TILE_BANK + (a % 2)*2 + ((y + *vpu->layer1_fsy) % 8)*4 +
                  (*vpu->layer1_tm)[(y >> 3)*VPU_TILE_XRES_FULL + (a >> 2)]));
     } else if(a < 128) {
         /* At cycle 64, read back last read request for layer 1. */
         if(a == 64)
-            *(uint16_t *)&vpu->sl__l1data_w[63 * 2] = core_mmu_rw_fetch_vpu(vpu->mmu);
+            *(uint16_t *)&vpu->sl__l1data_w[63 * 2] = core_vpu__fetch(vpu);
         else
-            *(uint16_t *)&vpu->sl__l2data_w[(a - 1 - 64)*2] = core_mmu_rw_fetch_vpu(vpu->mmu);
+            *(uint16_t *)&vpu->sl__l2data_w[(a - 1 - 64)*2] = core_vpu__fetch(vpu);
         /* Fetch the tile data for tile[y][x], where:
          * - y = (scanline - 12) / 8 (tiles are 8 scanlines tall)
          * - x = (c - 25) / (8/2) (tiles are 4 BYTES wide) */
-        core_mmu_rw_send_vpu(vpu->mmu,
+        core_vpu__send(vpu,
                 (VPU_A_TILE_BANK + (a % 2)*2 + ((y + *vpu->layer2_fsy) % 8)*4 +
                  (*vpu->layer2_tm)[(y >> 3)*VPU_TILE_XRES_FULL + ((a - 64) >> 2)]));
     } else if(a < 256) {
         unsigned int ac = a - 128;
         unsigned int cs = ac / 2;                           // Current sprite
-        struct core_vpu_sprite spr = *(struct core_vpu_sprite *)&(*vpu->spr_ctl)[cs * 4];
-        int vd = core_vpu__spr_vdouble(spr);
-        unsigned int sg = core_vpu__spr_group(spr);         // Sprite group
-        unsigned int gy0 = (*vpu->grp_pos)[sg*2 + 1];       // Group start y
-        unsigned int sy0 = gy0 + core_vpu__spr_yoffs(spr);  // Sprite start y
-        unsigned int csy = (y - sy0) >> vd;                 // Current sprite y
+        unsigned int sy0 = vpu->spr.y[cs];                  // Sprite start y
+        unsigned int csy = (y - sy0) >> vpu->spr.vdouble[cs]; // Current sprite y
         /* At cycle 128, read back last read request for layer 2. */
         if(a == 128)
-            *(uint16_t *)&vpu->sl__l2data_w[63 * 2] = core_mmu_rw_fetch_vpu(vpu->mmu);
+            *(uint16_t *)&vpu->sl__l2data_w[63 * 2] = core_vpu__fetch(vpu);
         else
-            *(uint16_t *)&vpu->sl__sdata_w[(ac - 1)*2] = core_mmu_rw_fetch_vpu(vpu->mmu);
+            *(uint16_t *)&vpu->sl__sdata_w[(ac - 1)*2] = core_vpu__fetch(vpu);
         /* Fetch the tile data for sprite i, where:
          * - i = (scanline - 12) / (8/2) */
-        core_mmu_rw_send_vpu(vpu->mmu,
+        core_vpu__send(vpu,
                  VPU_A_TILE_BANK +                          // Tile bank base
-                 (core_vpu__spr_tile(spr) * VPU_TILE_SZ) +  // Offset to sprite tile
+                 (vpu->spr.tile[cs] * VPU_TILE_SZ) +        // Offset to sprite tile
                  (csy * 4) +                                // Offset due to scanline
                  ((a % 2) * 2));                            // Offset due to sl. cycle
     } else if(a == 256) {
         /* Fetch the last word of sprite data. */
-        *(uint16_t *)&vpu->sl__sdata_w[127 * 2] = core_mmu_rw_fetch_vpu(vpu->mmu);
+        *(uint16_t *)&vpu->sl__sdata_w[127 * 2] = core_vpu__fetch(vpu);
+        if(vpu->renderer == VPU_RENDER_SCANLINE)
+            core_vpu__latch_rows(vpu, y);
     }
 }
 
 
-/* Return layer 2's tilemap pixel at the current scanline and cycle. */
-static struct rgba core_vpu__get_l2px(struct core_vpu *vpu, int scanline, int c)
+/* Read a word of tile data at once, from the bus or the render thread's copy. */
+static inline uint16_t core_vpu__peekw(struct core_vpu *vpu, uint16_t a)
+{
+    vpu->stats_cur.fetches += 1;
+    if(vpu->replica)
+        return core_vpu_pipe_readw(vpu->pipe, a);
+    return core_mmu_rw_vpu(vpu->mmu, a);
+}
+
+
+/*
+ * Make the same reads as core_vpu__fetch_data over a line, in the same order
+ * and into the same places, but all at once.
+ */
+static void core_vpu__fetch_block(struct core_vpu *vpu, unsigned int y)
+{
+    const uint8_t *tm1 = *vpu->layer1_tm + (y >> 3)*VPU_TILE_XRES_FULL;
+    const uint8_t *tm2 = *vpu->layer2_tm + (y >> 3)*VPU_TILE_XRES_FULL;
+    unsigned int row1 = ((y + *vpu->layer1_fsy) % 8)*4;
+    unsigned int row2 = ((y + *vpu->layer2_fsy) % 8)*4;
+    unsigned int k;
+
+    for(k = 0; k < 64; ++k)
+        *(uint16_t *)&vpu->sl__l1data_w[k*2] = core_vpu__peekw(vpu,
+                VPU_A_TILE_BANK + (k % 2)*2 + row1 + tm1[k >> 2]);
+    for(k = 0; k < 64; ++k)
+        *(uint16_t *)&vpu->sl__l2data_w[k*2] = core_vpu__peekw(vpu,
+                VPU_A_TILE_BANK + (k % 2)*2 + row2 + tm2[k >> 2]);
+    for(k = 0; k < 128; ++k) {
+        unsigned int cs = k / 2;
+        unsigned int sy0 = vpu->spr.y[cs];
+        unsigned int csy = (y - sy0) >> vpu->spr.vdouble[cs];
+
+        *(uint16_t *)&vpu->sl__sdata_w[k*2] = core_vpu__peekw(vpu,
+                VPU_A_TILE_BANK + vpu->spr.tile[cs]*VPU_TILE_SZ + csy*4 +
+                (k % 2)*2);
+    }
+}
+
+
+/*
+ * Record where in the tile bank the rows just read came from, the same way
+ * core_vpu__fetch_data addressed them. The VPU registers cannot have changed
+ * since: they are only written during H-SYNC or V-BLANK.
+ */
+static void core_vpu__latch_rows(struct core_vpu *vpu, unsigned int y)
+{
+    uint16_t *rows = vpu->sl__rows_w;
+    unsigned int j;
+
+    for(j = 0; j < 16; ++j) {
+        rows[j] = ((y + *vpu->layer1_fsy) % 8)*4 +
+            (*vpu->layer1_tm)[(y >> 3)*VPU_TILE_XRES_FULL + j];
+        rows[16 + j] = ((y + *vpu->layer2_fsy) % 8)*4 +
+            (*vpu->layer2_tm)[(y >> 3)*VPU_TILE_XRES_FULL + j];
+    }
+    for(j = 0; j < VPU_NUM_SPRITES; ++j) {
+        unsigned int sy0 = vpu->spr.y[j];
+        unsigned int csy = (y - sy0) >> vpu->spr.vdouble[j];
+        uint16_t a = VPU_A_TILE_BANK + vpu->spr.tile[j]*VPU_TILE_SZ + csy*4;
+
+        if(a >= VPU_A_TILE_BANK && a + 3 < VPU_A_TILE_BANK + MMU_TILE_BANK_SZ)
+            rows[32 + j] = a - VPU_A_TILE_BANK;
+        else
+            rows[32 + j] = VPU_ROW_NONE;
+    }
+}
+
+
+/* Return layer 2's palette entry at the current cycle. */
+static int core_vpu__l2_entry(struct core_vpu *vpu, int c)
 {
     int x = (c - 65) & 255;
     int tx = x / 2;
     uint8_t e = vpu->sl__l2data_r[tx];
-    e = (c & 1) ? (e >> 4) : (e & 0xf);
-
-    uint8_t pal = (*vpu->layers_pi) >> 4;
-    return pal_fixed[(*vpu->pals)[pal*VPU_PALETTE_SZ + e]];
+    return (c & 1) ? (e >> 4) : (e & 0xf);
 }
 
 
-/* Return layer 1's tilemap pixel at the current scanline and cycle. */
-static struct rgba core_vpu__get_l1px(struct core_vpu *vpu, int scanline, int c,
-                                      struct rgba below)
+/* Return layer 1's palette entry at the current cycle; 0 is transparent. */
+static int core_vpu__l1_entry(struct core_vpu *vpu, int c)
 {
     int x = (c - 65) & 255;
     int tx = (*vpu->layer1_fsx + x / 2) % (32*4);
     uint8_t e = vpu->sl__l1data_r[tx];
-    e = (c & 1) ? (e >> 4) : (e & 0xf);
-
-    uint8_t pal = (*vpu->layers_pi) & 0xf;
-    return e ? pal_fixed[(*vpu->pals)[pal*VPU_PALETTE_SZ + e]] : below;
+    return (c & 1) ? (e >> 4) : (e & 0xf);
 }
 
 
-/* Return sprite i's pixel at the current scanline and cycle. */
-static struct rgba core_vpu__get_spx(struct core_vpu *vpu, int scanline, int c,
-                                    int i, struct rgba below)
+/*
+ * Return sprite i's palette entry at the current cycle; 0 is transparent, and
+ * -1 a clear pixel, left of where the sprite's group places its data.
+ */
+static int core_vpu__spr_entry(struct core_vpu *vpu, int c, int i)
 {
-    struct rgba dummy = { 0 };
     int x = (c - 65) & 255;
     uint8_t grp = (*vpu->spr_ctl)[i*4 + 1];
-    int h2 = !!((*vpu->spr_ctl)[i*4] & VPU_SPR_HDOUBLE);
+    int h2 = vpu->spr.hdouble[i];
     int spx = (*vpu->grp_pos)[grp*2] + (((*vpu->spr_ctl)[i*4 + 2] >> 4) - 8)*8;
     int tx = (x - spx) >> (1 + h2);
     if(tx < 0)
-        return dummy;
+        return -1;
     uint8_t e = vpu->sl__sdata_r[i*4 + tx];
     int lp = !(((x - spx) >> h2) & 1);
-    e = lp ? (e >> 4) : (e & 0xf);
+    return lp ? (e >> 4) : (e & 0xf);
+}
+
 
+/* Return layer 2's tilemap pixel at the current scanline and cycle. */
+static struct rgba core_vpu__get_l2px(struct core_vpu *vpu, int scanline, int c)
+{
+    return vpu->l2_pal[core_vpu__l2_entry(vpu, c)];
+}
+
+
+/* Return layer 1's tilemap pixel at the current scanline and cycle. */
+static struct rgba core_vpu__get_l1px(struct core_vpu *vpu, int scanline, int c,
+                                      struct rgba below)
+{
+    int e = core_vpu__l1_entry(vpu, c);
+    return e ? vpu->l1_pal[e] : below;
+}
+
+
+/* Return sprite i's pixel at the current scanline and cycle. */
+static struct rgba core_vpu__get_spx(struct core_vpu *vpu, int scanline, int c,
+                                    int i, struct rgba below)
+{
+    struct rgba dummy = { 0 };
+    int e = core_vpu__spr_entry(vpu, c, i);
     uint8_t pal = (*vpu->spr_pi);
-    return e ? pal_fixed[(*vpu->pals)[pal*VPU_PALETTE_SZ + e]] : below;
+
+    if(e < 0)
+        return dummy;
+    if(!e)
+        return below;
+    if(vpu->spr_pal != NULL)
+        return vpu->spr_pal[e];
+    return pal_fixed[(*vpu->pals)[pal*VPU_PALETTE_SZ + e]];
+}
+
+
+/*
+ * Rebuild the resolved palettes which were written to, and pick the ones the
+ * index registers select. A sprite palette index past the palettes reads other
+ * VPU memory, which can change without notice; it is left unresolved.
+ */
+static void core_vpu__update_pals(struct core_vpu *vpu)
+{
+    int p, e;
+
+    if(vpu->pal_dirty == 0)
+        return;
+
+    for(p = 0; p < VPU_PALETTE_NUM; ++p) {
+        if(!(vpu->pal_dirty & (1 << p)))
+            continue;
+        for(e = 0; e < VPU_PALETTE_SZ; ++e)
+            vpu->pal_rgba[p][e] = pal_fixed[(*vpu->pals)[p*VPU_PALETTE_SZ + e]];
+    }
+    vpu->l1_pal = vpu->pal_rgba[*vpu->layers_pi & 0xf];
+    vpu->l2_pal = vpu->pal_rgba[*vpu->layers_pi >> 4];
+    vpu->spr_pal = *vpu->spr_pi < VPU_PALETTE_NUM ?
+        vpu->pal_rgba[*vpu->spr_pi] : NULL;
+    vpu->pal_dirty = 0;
+}
+
+
+/*
+ * Build the list of enabled sprites crossing a scanline, in drawing order.
+ * Sprite state cannot change during a line's pixel data, so the list holds
+ * for the whole line.
+ */
+static void core_vpu__eval_sprites(struct core_vpu *vpu, int scanline)
+{
+    const struct core_vpu_sprites *t = &vpu->spr;
+    int depth[VPU_NUM_SPRITES];
+    int i, j, n = 0;
+
+    for(i = 0; i < VPU_NUM_SPRITES; ++i) {
+        if (!t->enabled[i])
+            continue;
+        int startx = t->x[i];
+        int endx = startx + t->w[i];
+        int starty = t->y[i];
+        int endy = starty + t->h[i];
+        int d = t->depth[i];
+        if(((scanline-16) < starty) || ((scanline-16) >= endy))
+            continue;
+
+        /* Insert after every sprite of greater or equal depth. */
+        for(j = n; j > 0 && depth[j - 1] < d; --j) {
+            vpu->sl__active[j] = vpu->sl__active[j - 1];
+            depth[j] = depth[j - 1];
+        }
+        vpu->sl__active[j].i = i;
+        vpu->sl__active[j].startx = startx;
+        vpu->sl__active[j].endx = endx;
+        depth[j] = d;
+        n += 1;
+    }
+    vpu->sl__active_num = n;
+
+    if((unsigned int)n < vpu->stats_cur.sprites_min)
+        vpu->stats_cur.sprites_min = n;
+    if((unsigned int)n > vpu->stats_cur.sprites_max)
+        vpu->stats_cur.sprites_max = n;
+    vpu->stats_cur.sprites_sum += n;
+}
+
+
+/* Return the sprites' pixel over below, at the current scanline and cycle. */
+static struct rgba core_vpu__get_sprites_px(struct core_vpu *vpu, int scanline,
+                                            int c, struct rgba below)
+{
+    struct rgba out = below;
+    int k, x = c - 65;
+
+    for(k = 0; k < vpu->sl__active_num; ++k) {
+        struct core_vpu_active *s = &vpu->sl__active[k];
+        if((x >= s->startx) && (x < s->endx))
+            out = core_vpu__get_spx(vpu, scanline, c, s->i, out);
+    }
+    return out;
+}
+
+
+/*
+ * Bring the tile cache up to date, and return the current bank's if the rows
+ * latched for this line can be taken from it: that is, unless the bank was
+ * written or switched since they were read, in which case only the scanline
+ * temporaries hold them.
+ */
+static struct core_vpu_tile_bank *core_vpu__tiles_ready(struct core_vpu *vpu)
+{
+    if(vpu->tiles == NULL)
+        return NULL;
+    if(core_vpu_tiles_sync(vpu->tiles, vpu->tile_bank_num) > 0)
+        vpu->sl__tiles_stale = 2;
+    if(vpu->sl__tiles_stale > 0) {
+        vpu->sl__tiles_stale -= 1;
+        return NULL;
+    }
+    return core_vpu_tiles_bank(vpu->tiles, vpu->tile_bank_num);
+}
+
+
+/* Copy a layer's 16 tile rows from the cache; each is read twice. */
+static void core_vpu__layer_rows(struct core_vpu_tile_bank *tb,
+        const uint8_t *mem, const uint16_t *rows, uint8_t *px)
+{
+    int j;
+
+    for(j = 0; j < 16; ++j) {
+        const uint8_t *p = core_vpu_tiles_row(tb, mem, rows[j]);
+        memcpy(px + j*16, p, 8);
+        memcpy(px + j*16 + 8, p, 8);
+    }
+}
+
+
+/*
+ * Render a whole scanline from the latched scanline data, as the cycle renderer
+ * would over cycles 65-320. The result is the same as long as the VPU state
+ * does not change during the line's pixel data.
+ * The line is built as fixed palette entries using the pixel kernels: layer 2,
+ * then layer 1 and the sprites blended over it, and only then expanded to RGBA.
+ */
+static void core_vpu__render_line(struct core_vpu *vpu, int scanline)
+{
+    const struct core_vpu_simd *k = vpu->simd;
+    struct rgba *fb = (struct rgba *) vpu->rgba_fb + (scanline - 16) * VPU_XRES;
+    uint16_t *ixfb = (uint16_t *) vpu->rgba_fb + (scanline - 16) * VPU_XRES;
+    uint8_t line[VPU_XRES], px[VPU_XRES], row[VPU_XRES];
+    uint8_t *pals = *vpu->pals;
+    int f = *vpu->layer1_fsx % (32 * 4);
+    struct core_vpu_tile_bank *tb = core_vpu__tiles_ready(vpu);
+    int y = scanline - 16;
+    uint64_t h;
+    int i, x;
+
+    /*
+     * A sprite whose group byte has its top bits set is positioned using two
+     * different groups (see core_vpu__get_spx), which can make it draw clear
+     * pixels; and a sprite palette past the palettes may read pixels as they
+     * are written. Those are left to the per-pixel functions.
+     */
+    for(i = 0; i < vpu->sl__active_num && vpu->spr_pal != NULL; ++i) {
+        struct core_vpu_active *s = &vpu->sl__active[i];
+        uint8_t grp = (*vpu->spr_ctl)[s->i*4 + 1];
+        int spx = (*vpu->grp_pos)[grp*2] + (((*vpu->spr_ctl)[s->i*4 + 2] >> 4) - 8)*8;
+        if(spx != s->startx)
+            break;
+    }
+    if(i < vpu->sl__active_num) {
+        for(x = 0; x < VPU_XRES && vpu->output == VPU_OUTPUT_INDEXED; ++x)
+            ixfb[x] = core_vpu__get_ix(vpu, scanline, x + 65);
+        for(x = 0; x < VPU_XRES && vpu->output == VPU_OUTPUT_RGBA; ++x) {
+            struct rgba out;
+            int c = x + 65;
+
+            out = core_vpu__get_l2px(vpu, scanline, c);
+            out = core_vpu__get_l1px(vpu, scanline, c, out);
+            fb[x] = core_vpu__get_sprites_px(vpu, scanline, c, out);
+        }
+        vpu->sl__hash_ok[vpu->fb_index][y] = 0;
+        vpu->sl__frame_ok[y] = 0;
+        vpu->damage_rows[y >> 6] |= (uint64_t)1 << (y & 63);
+        core_vpu__stats_line(vpu);
+        return;
+    }
+
+    /*
+     * Skip the line if it would be drawn from the same data as the row holds:
+     * the latched tile rows, the fine scroll, the three 16-entry maps, and the
+     * sprites crossing it with their rows. The tile cache holds the same rows
+     * as the latches whenever it is used.
+     */
+    h = core_vpu__hash(0, vpu->sl__l2data_r, 32 * 4);
+    h = core_vpu__hash(h, vpu->sl__l1data_r, 32 * 4);
+    h = core_vpu__hash(h, &f, sizeof(f));
+    h = core_vpu__hash(h, pals + ((*vpu->layers_pi) >> 4)*VPU_PALETTE_SZ,
+            VPU_PALETTE_SZ);
+    h = core_vpu__hash(h, pals + ((*vpu->layers_pi) & 0xf)*VPU_PALETTE_SZ,
+            VPU_PALETTE_SZ);
+    if(vpu->sl__active_num > 0)
+        h = core_vpu__hash(h, pals + (*vpu->spr_pi)*VPU_PALETTE_SZ,
+                VPU_PALETTE_SZ);
+    for(i = 0; i < vpu->sl__active_num; ++i) {
+        struct core_vpu_active *s = &vpu->sl__active[i];
+        h = core_vpu__hash(h, s, sizeof(*s));
+        h = core_vpu__hash(h, &(*vpu->spr_ctl)[s->i*4], 1);
+        h = core_vpu__hash(h, vpu->sl__sdata_r + s->i*4, 4);
+    }
+    if(!vpu->sl__frame_ok[y] || vpu->sl__frame_hash[y] != h)
+        vpu->damage_rows[y >> 6] |= (uint64_t)1 << (y & 63);
+    vpu->sl__frame_hash[y] = h;
+    vpu->sl__frame_ok[y] = 1;
+    if(vpu->sl__hash_ok[vpu->fb_index][y] && vpu->sl__hash[vpu->fb_index][y] == h) {
+        vpu->stats_cur.lines_skipped += 1;
+        return;
+    }
+    core_vpu__stats_line(vpu);
+    vpu->sl__hash[vpu->fb_index][y] = h;
+    vpu->sl__hash_ok[vpu->fb_index][y] = 1;
+
+    /* Layer 2 has no transparent pixels. */
+    if(tb != NULL)
+        core_vpu__layer_rows(tb, vpu->tile_bank, vpu->sl__rows_r + 16, px);
+    else
+        k->unpack(px, vpu->sl__l2data_r, 32 * 4);
+    k->lookup(line, px, pals + ((*vpu->layers_pi) >> 4)*VPU_PALETTE_SZ,
+            VPU_XRES);
+
+    /* Layer 1 is fine scrolled, wrapping around its tile data. */
+    if(tb != NULL) {
+        core_vpu__layer_rows(tb, vpu->tile_bank, vpu->sl__rows_r, row);
+        memcpy(px, row + f*2, VPU_XRES - f*2);
+        memcpy(px + VPU_XRES - f*2, row, f*2);
+    } else {
+        memcpy(row, vpu->sl__l1data_r + f, 32 * 4 - f);
+        memcpy(row + 32 * 4 - f, vpu->sl__l1data_r, f);
+        k->unpack(px, row, 32 * 4);
+    }
+    k->blend(line, px, pals + ((*vpu->layers_pi) & 0xf)*VPU_PALETTE_SZ,
+            VPU_XRES);
+
+    /* The sprites, in drawing order, clipped to the screen. */
+    for(i = 0; i < vpu->sl__active_num; ++i) {
+        struct core_vpu_active *s = &vpu->sl__active[i];
+        int h2 = vpu->spr.hdouble[s->i];
+        int x0 = s->startx < 0 ? 0 : s->startx;
+        int x1 = s->endx > VPU_XRES ? VPU_XRES : s->endx;
+        uint16_t o = vpu->sl__rows_r[32 + s->i];
+        const uint8_t *src = px;
+        uint8_t run[16];
+
+        if(x0 >= x1)
+            continue;
+        if(tb != NULL && o != VPU_ROW_NONE)
+            src = core_vpu_tiles_row(tb, vpu->tile_bank, o);
+        else
+            k->unpack(px, vpu->sl__sdata_r + s->i*4, 4);
+        for(x = 0; x < (8 << h2); ++x)
+            run[x] = src[x >> h2];
+        k->blend(line + x0, run + (x0 - s->startx),
+                pals + (*vpu->spr_pi)*VPU_PALETTE_SZ, x1 - x0);
+    }
+
+    if(vpu->output == VPU_OUTPUT_INDEXED) {
+        for(x = 0; x < VPU_XRES; ++x)
+            ixfb[x] = line[x];
+    } else {
+        k->expand(fb, line, pal_fixed, VPU_XRES);
+    }
+}
+
+
+/* Mix n bytes into a hash, a word at a time where possible. */
+static uint64_t core_vpu__hash(uint64_t h, const void *p, size_t n)
+{
+    const uint8_t *b = p;
+    uint64_t v;
+
+    for(; n >= 8; n -= 8, b += 8) {
+        memcpy(&v, b, 8);
+        h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    for(; n > 0; --n, ++b)
+        h = (h ^ *b) * 0x100000001b3ull;
+    return h;
+}
+
+
+/*
+ * Turn the rows drawn during the frame into bands, and start over. The cycle
+ * renderer draws every row each frame.
+ */
+static void core_vpu__damage(struct core_vpu *vpu)
+{
+    int y, n = 0;
+
+    if(vpu->renderer == VPU_RENDER_CYCLE)
+        memset(vpu->damage_rows, 0xff, sizeof(vpu->damage_rows));
+
+    for(y = 0; y < VPU_YRES; ++y) {
+        if(!(vpu->damage_rows[y >> 6] & ((uint64_t)1 << (y & 63))))
+            continue;
+        if(n > 0 && vpu->damage[n - 1].y + vpu->damage[n - 1].h == y) {
+            vpu->damage[n - 1].h += 1;
+        } else {
+            vpu->damage[n].y = y;
+            vpu->damage[n].h = 1;
+            n += 1;
+        }
+    }
+    vpu->damage_num = n;
+    memset(vpu->damage_rows, 0, sizeof(vpu->damage_rows));
+}
+
+
+/*
+ * Return the fixed palette index of the pixel at the current scanline and
+ * cycle, as the functions above would find its colour.
+ */
+static uint16_t core_vpu__get_ix(struct core_vpu *vpu, int scanline, int c)
+{
+    uint8_t *pals = *vpu->pals;
+    uint16_t ix;
+    int k, e, x = c - 65;
+
+    ix = pals[((*vpu->layers_pi) >> 4)*VPU_PALETTE_SZ +
+        core_vpu__l2_entry(vpu, c)];
+    e = core_vpu__l1_entry(vpu, c);
+    if(e)
+        ix = pals[((*vpu->layers_pi) & 0xf)*VPU_PALETTE_SZ + e];
+    for(k = 0; k < vpu->sl__active_num; ++k) {
+        struct core_vpu_active *s = &vpu->sl__active[k];
+        if(x < s->startx || x >= s->endx)
+            continue;
+        e = core_vpu__spr_entry(vpu, c, s->i);
+        if(e < 0)
+            ix = VPU_IX_CLEAR;
+        else if(e)
+            ix = pals[(*vpu->spr_pi)*VPU_PALETTE_SZ + e];
+    }
+    return ix;
+}
+
+
+/* Expand n indexed pixels to RGBA. */
+void core_vpu_expand_indexed(struct rgba *dst, const uint16_t *src, int n)
+{
+    int i;
+
+    for(i = 0; i < n; ++i)
+        dst[i] = pal_fixed[src[i]];
 }
 
 
@@ -616,23 +1319,151 @@ static void core_vpu__write_px(struct core_vpu *vpu, int scanline, int c,
 }
 
 
-/* Signal the start of the VBlank period, by firing the video interrupt. */
+/*
+ * Signal the start of the VBlank period, by firing the video interrupt, and
+ * hand the frame over; with a render thread, its instance does the latter.
+ */
 void core_vpu_begin_vblank(struct core_vpu *vpu)
 {
-    vpu->cpu->interrupt = INT_VIDEO_IRQ;
+    uint64_t t = core_vpu__clock(vpu);
+    uint8_t *fb = vpu->rgba_fb;
+    int i;
+
     vpu->vblank = 1;
-    ui_lock_fb();
-    {
-        void *uifb = ui_get_fb();
-        memcpy(uifb, vpu->rgba_fb, VPU_XRES * VPU_YRES * 4);
+    if(!vpu->replica)
+        vpu->cpu->interrupt = INT_VIDEO_IRQ;
+    if(core_vpu__draws(vpu) && !vpu->skipping) {
+        core_vpu__damage(vpu);
+
+        /* Hand the frame over as it is, and carry on in another framebuffer. */
+        for(i = 0; i < vpu->damage_num; ++i)
+            ui_damage_fb(vpu->damage[i].y, vpu->damage[i].h);
+        vpu->fb_index = ui_fb_publish(vpu->output == VPU_OUTPUT_INDEXED ?
+                UI_FB_INDEXED : UI_FB_RGBA);
+        vpu->rgba_fb = vpu->mmu->arena.base + vpu->mmu->arena.vpu_fb +
+            (size_t)vpu->fb_index * MMU_VPU_FB_SZ;
+        vpu->stats_cur.host_ns += core_vpu__clock(vpu) - t;
+    }
+    core_vpu__stats_frame(vpu);
+
+    if(core_vpu__draws(vpu) && vpu->frame_fn != NULL) {
+        t = core_vpu_now_ns();
+        vpu->frame_fn(vpu->frame_ctx, vpu->skipping ? NULL : fb, vpu->output,
+                &vpu->stats);
+        if(vpu->replica)
+            vpu->frame_fn_ns += core_vpu_now_ns() - t;
+    }
+}
+
+
+/* Count a line drawn, with the pixels of each layer and of the sprites. */
+static void core_vpu__stats_line(struct core_vpu *vpu)
+{
+    struct core_vpu_stats *s = &vpu->stats_cur;
+    int i;
+
+    s->lines_drawn += 1;
+    s->px_l2 += VPU_XRES;
+    s->px_l1 += VPU_XRES;
+    for(i = 0; i < vpu->sl__active_num; ++i) {
+        int x0 = vpu->sl__active[i].startx;
+        int x1 = vpu->sl__active[i].endx;
+
+        x0 = x0 < 0 ? 0 : x0;
+        x1 = x1 > VPU_XRES ? VPU_XRES : x1;
+        if(x0 < x1)
+            s->px_spr += x1 - x0;
+    }
+}
+
+
+/*
+ * Publish the frame's counters and start counting the next. The copy is made
+ * between two increments of stats_seq, so that a reader on another thread can
+ * tell it raced with one.
+ */
+static void core_vpu__stats_frame(struct core_vpu *vpu)
+{
+    struct core_vpu_stats *s = &vpu->stats_cur;
+    unsigned int seq = atomic_load_explicit(&vpu->stats_seq,
+            memory_order_relaxed);
+    unsigned int frame = s->frame;
+
+    if(s->sprites_min > s->sprites_max)
+        s->sprites_min = 0;
+    atomic_store_explicit(&vpu->stats_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    vpu->stats = *s;
+    atomic_store_explicit(&vpu->stats_seq, seq + 2, memory_order_release);
+
+    memset(s, 0, sizeof(*s));
+    s->frame = frame + 1;
+    s->sprites_min = ~0u;
+}
+
+
+/* Copy the last frame's counters, retrying if it was being published. */
+static void core_vpu__stats_read(struct core_vpu *vpu,
+        struct core_vpu_stats *out)
+{
+    unsigned int seq;
+
+    do {
+        seq = atomic_load_explicit(&vpu->stats_seq, memory_order_acquire);
+        *out = vpu->stats;
+        atomic_thread_fence(memory_order_acquire);
+    } while((seq & 1) ||
+            seq != atomic_load_explicit(&vpu->stats_seq, memory_order_relaxed));
+}
+
+
+/*
+ * Return the counters of the last frame drawn, from whichever thread draws
+ * them. Denied writes are counted where the CPU makes them.
+ */
+void core_vpu_get_stats(struct core_vpu *vpu, struct core_vpu_stats *out)
+{
+    struct core_vpu_stats own;
+
+    if(core_vpu__draws(vpu)) {
+        core_vpu__stats_read(vpu, out);
+        return;
     }
-    ui_unlock_fb();   
+    core_vpu__stats_read(vpu->pipe->render, out);
+    core_vpu__stats_read(vpu, &own);
+    out->writes_denied = own.writes_denied;
+}
+
+
+/*
+ * Have fn called with each frame drawn. Set it before starting a render
+ * thread, whose instance takes it over.
+ */
+void core_vpu_frame_observe(struct core_vpu *vpu, core_vpu_frame_fn fn,
+        void *ctx)
+{
+    vpu->frame_fn = fn;
+    vpu->frame_ctx = ctx;
+}
+
+
+/* Return a monotonic host time, in nanoseconds. */
+uint64_t core_vpu_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
 }
 
 /* Signal the end of the VBlank period. */
 void core_vpu_end_vblank(struct core_vpu *vpu)
 {
     vpu->vblank = 0;
+
+    /* Whether to draw the frame coming, before its first line is fetched. */
+    vpu->skipping = vpu->draw_every == 0 ||
+        vpu->draw_count++ % vpu->draw_every != 0;
 }
 
 
@@ -648,16 +1479,38 @@ uint8_t core_vpu_readb(struct core_vpu *vpu, uint16_t a)
     return vpu->mem[a - 0xe000];
 }
 
-void core_vpu_writeb(struct core_vpu *vpu, uint16_t a, uint8_t v)
+/* Write a byte to VPU memory. Returns 0 if the write was denied. */
+int core_vpu_writeb(struct core_vpu *vpu, uint16_t a, uint8_t v)
 {
     if(!vpu->vblank && !vpu->hsync) {
+        vpu->stats_cur.writes_denied += 1;
         LOGW("core.vpu: write denied: vblank = 0");
-        return;
+        return 0;
     }
 #ifdef _DEBUG_MEMORY
     LOGW("core.vpu: wrote %02x @ $%04x", v, a);
 #endif
+    core_vpu_store(vpu, a, v);
+    if(vpu->pipe != NULL)
+        core_vpu_pipe_log(vpu->pipe, VPU_EV_WRITE, a, v);
+    return 1;
+}
+
+/* Store a byte to VPU memory, whatever the VPU is doing. */
+void core_vpu_store(struct core_vpu *vpu, uint16_t a, uint8_t v)
+{
     vpu->mem[a - 0xe000] = v;
+
+    /* Keep the resolved palettes in step. */
+    if(a >= VPU_A_PALS && a <= VPU_A_PALS_END)
+        vpu->pal_dirty |= 1 << ((a - VPU_A_PALS) / VPU_PALETTE_SZ);
+    else if(a == VPU_A_L12_PAL || a == VPU_A_SPR_PAL)
+        vpu->pal_dirty |= VPU_PAL_DIRTY_SEL;
+    /* And the decoded sprites. */
+    else if(a >= VPU_A_SPRCTL && a <= VPU_A_SPRCTL_END)
+        core_vpu__decode_sprite(vpu, (a - VPU_A_SPRCTL) / 4);
+    else if(a >= VPU_A_SPRCOORD && a <= VPU_A_SPRCOORD_END)
+        core_vpu__place_group(vpu, (a - VPU_A_SPRCOORD) / 2);
 }
 
 uint16_t core_vpu_readw(struct core_vpu *vpu, uint16_t a)
@@ -10,6 +10,9 @@
 #define QPRA_CORE_VPU_H
 
 #include <stdint.h>
+#include <stdatomic.h>
+
+#include "core/mmu/mmu.h"
 
 #define VPU_CLOCK_HZ        21442080
 
@@ -67,6 +70,47 @@
 
 struct core_cpu;
 struct core_mmu;
+struct core_vpu_simd;
+
+/*
+ * How pixels are produced: one per cycle, following any change of VPU state
+ * mid-line, or a whole scanline at once at the end of its pixel data.
+ */
+enum core_vpu_renderer {
+    VPU_RENDER_SCANLINE, VPU_RENDER_CYCLE
+};
+
+/*
+ * How tile data is read: a word each cycle of the line's fetch, sharing the
+ * bus with the CPU, or all of the line's at once at the end of the fetch. The
+ * two read the same, unless the CPU writes or switches the tile bank during
+ * the fetch; the block fetch is for when that is not worth modelling.
+ */
+enum core_vpu_fetch {
+    VPU_FETCH_BUS, VPU_FETCH_BLOCK
+};
+
+/*
+ * How the VPU keeps up with the CPU: run a cycle alongside each of the CPU's,
+ * or fall behind and catch up only when it could tell. That is before the CPU
+ * touches the tile bank, VPU memory or the bank registers, and at the cycle
+ * the video interrupt is due; the core also catches it up every frame.
+ */
+enum core_vpu_sync {
+    VPU_SYNC_LOCKSTEP, VPU_SYNC_LAZY
+};
+
+/*
+ * What the framebuffer holds: RGBA pixels, or 16-bit indices into the fixed
+ * palette, to be expanded by whoever needs RGBA (core_vpu_expand_indexed).
+ * Pixels only come from the first 256 entries; VPU_IX_CLEAR is the clear
+ * pixel a sprite may draw, which the entries past those stand for.
+ */
+enum core_vpu_output {
+    VPU_OUTPUT_RGBA, VPU_OUTPUT_INDEXED
+};
+
+#define VPU_IX_CLEAR        256
 
 /* Structure used as an overlay over framebuffer. */
 struct rgba {
@@ -84,6 +128,82 @@ struct core_vpu_sprite {
     uint8_t b3;
 };
 
+/* Bit in pal_dirty for the palette index registers. */
+#define VPU_PAL_DIRTY_SEL   (1 << VPU_PALETTE_NUM)
+
+/* Latched tile row of a unit not wholly inside the tile bank. */
+#define VPU_ROW_NONE        0xffff
+
+/* A sprite crossing the current scanline, and the X range it covers. */
+struct core_vpu_active {
+    int i;
+    int startx;
+    int endx;
+};
+
+/*
+ * The sprite attributes decoded, one array per attribute, and kept that way by
+ * every write to the sprite control and group position tables. Positions are
+ * absolute: the sprite's group's, plus its offset. Each group keeps a bitmap
+ * of its sprites, whose positions follow when it moves.
+ */
+struct core_vpu_sprites {
+    uint8_t enabled[VPU_NUM_SPRITES];
+    uint8_t depth[VPU_NUM_SPRITES];
+    int16_t x[VPU_NUM_SPRITES];
+    int16_t y[VPU_NUM_SPRITES];
+    uint8_t w[VPU_NUM_SPRITES];
+    uint8_t h[VPU_NUM_SPRITES];
+    uint8_t hmirror[VPU_NUM_SPRITES];
+    uint8_t vmirror[VPU_NUM_SPRITES];
+    uint8_t hdouble[VPU_NUM_SPRITES];
+    uint8_t vdouble[VPU_NUM_SPRITES];
+    uint8_t tile[VPU_NUM_SPRITES];
+    uint8_t group[VPU_NUM_SPRITES];
+
+    uint64_t members[VPU_NUM_GROUPS];
+};
+
+struct core_vpu_tiles;
+struct core_vpu_pipe;
+
+/* A band of framebuffer rows which changed during a frame. */
+struct core_vpu_damage {
+    int y;
+    int h;
+};
+
+/*
+ * Counters over a frame, cheap enough to be always kept. Lines are those of
+ * the picture; a skipped one held what it would have been drawn as. Sprites
+ * are those crossing each line, and pixels those drawn for each layer and the
+ * sprites. Host time covers the scanline renderer, the block fetch and handing
+ * frames over, or all of the render thread's work if there is one; the cycle
+ * renderer's pixels are not timed, which would cost more than drawing them.
+ */
+struct core_vpu_stats {
+    unsigned int frame;
+    unsigned int lines_drawn;
+    unsigned int lines_skipped;
+    unsigned int sprites_min;
+    unsigned int sprites_max;
+    unsigned int sprites_sum;
+    uint64_t px_l2;
+    uint64_t px_l1;
+    uint64_t px_spr;
+    unsigned int fetches;
+    unsigned int writes_denied;
+    uint64_t host_ns;
+};
+
+/*
+ * Called with each frame drawn, once handed over: the framebuffer it is in,
+ * what it holds (see core_vpu_output), and its counters. The framebuffer is
+ * NULL for a frame skipped (see draw_every).
+ */
+typedef void (*core_vpu_frame_fn)(void *, const void *, int,
+        const struct core_vpu_stats *);
+
 /* VPU state structure. */
 struct core_vpu {
     struct core_cpu *cpu;
@@ -93,9 +213,37 @@ struct core_vpu {
     int vblank;
     /* HSync status flag. */
     int hsync;
+    /* Current scanline. */
+    int scanline;
 
-    /* Switchable tile bank. */
+    /* Which renderer to use, and the pixel kernels for the scanline one. */
+    enum core_vpu_renderer renderer;
+    const struct core_vpu_simd *simd;
+    /* What to write to the framebuffer. */
+    enum core_vpu_output output;
+    /* How to read tile data. */
+    enum core_vpu_fetch fetch;
+    /*
+     * How to keep up with the CPU; for lazy sync, the next cycle to run, and
+     * the first the CPU must not run before the VPU has caught up with it.
+     */
+    enum core_vpu_sync sync;
+    uint64_t cycle;
+    uint64_t deadline;
+    /*
+     * Draw one frame in this many, or none if 0. Frames not drawn keep their
+     * timing, V-BLANK and interrupt, but fetch nothing and leave the
+     * framebuffers alone; whether the current one is, is decided as it starts.
+     */
+    unsigned int draw_every;
+    unsigned int draw_count;
+    int skipping;
+
+    /* Switchable tile bank; kept current by the MMU's bank switch calls. */
     uint8_t *tile_bank;
+    uint8_t tile_bank_num;
+    /* The tile banks expanded to pixel indices, for the scanline renderer. */
+    struct core_vpu_tiles *tiles;
     /* Array representing remainder of VPU address space. */
     uint8_t *mem;
 
@@ -122,8 +270,15 @@ struct core_vpu {
 
     uint8_t *tile_s_bank;
 
-    /* RGBA32 framebuffer pointer. */
+    /* The sprite control and group position tables, decoded. */
+    struct core_vpu_sprites spr;
+
+    /*
+     * RGBA32 (or indexed, see output) framebuffer pointer: one of
+     * MMU_VPU_FB_NUM, handed to the UI in turn, and which one.
+     */
     uint8_t *rgba_fb;
+    int fb_index;
 
     /* Scanline temporaries (read in for each scanline by the VPU). */
     uint8_t sl__l1data[2][32 * 4];
@@ -140,24 +295,108 @@ struct core_vpu {
     uint8_t *sl__l2data_w;
     uint8_t *sl__sdata_r;
     uint8_t *sl__sdata_w;
+    /*
+     * Tile bank offsets of the rows read into the scanline temporaries: for
+     * each of the 16 tiles of layers 1 and 2, then each sprite. The scanline
+     * renderer takes the rows from the tile cache instead, unless the bank
+     * was written or switched since the rows were read (sl__tiles_stale).
+     */
+    uint16_t sl__rows[2][16 + 16 + VPU_NUM_SPRITES];
+    uint16_t *sl__rows_r;
+    uint16_t *sl__rows_w;
+    int sl__tiles_stale;
+    /*
+     * Sprites crossing the current scanline, evaluated once at the start of
+     * its pixel data. They are in drawing order: by decreasing depth, so that
+     * depth 0 is on top, then by sprite number.
+     */
+    struct core_vpu_active sl__active[VPU_NUM_SPRITES];
+    int sl__active_num;
     struct rgba sl__l1pal[16];
     struct rgba sl__l2pal[16];
     struct rgba sl__spal[16];
+
+    /*
+     * The palettes resolved to RGBA, rebuilt only after writes to the palettes
+     * (one dirty bit each) or to the palette index registers. The layers and
+     * sprites use the ones their index registers select; the sprite index may
+     * point past the palettes, in which case spr_pal is NULL.
+     */
+    struct rgba pal_rgba[VPU_PALETTE_NUM][VPU_PALETTE_SZ];
+    uint32_t pal_dirty;
+    struct rgba *l1_pal;
+    struct rgba *l2_pal;
+    struct rgba *spr_pal;
+
+    /*
+     * A hash of everything the scanline renderer drew each row of each
+     * framebuffer from, if the row still holds what was drawn from it. A row
+     * whose inputs hash the same is not drawn again. The same for the rows of
+     * the last frame, whichever framebuffer they went to, tells which changed.
+     */
+    uint64_t sl__hash[MMU_VPU_FB_NUM][VPU_YRES];
+    uint8_t sl__hash_ok[MMU_VPU_FB_NUM][VPU_YRES];
+    uint64_t sl__frame_hash[VPU_YRES];
+    uint8_t sl__frame_ok[VPU_YRES];
+
+    /*
+     * Rows drawn differently during the current frame, and the same as bands
+     * of rows for the last complete frame, for the UI and other consumers of
+     * the framebuffer to update only those.
+     */
+    uint64_t damage_rows[(VPU_YRES + 63) / 64];
+    struct core_vpu_damage damage[VPU_YRES];
+    int damage_num;
+
+    /*
+     * The render thread, if frames are drawn on one (see pipe.h). The instance
+     * there is a replica, reading video memory from its own copies instead of
+     * over the bus; bus_* stand for its read request, as they do for lazy
+     * sync.
+     */
+    struct core_vpu_pipe *pipe;
+    int replica;
+    int bus_pending;
+    uint16_t bus_a;
+    uint16_t bus_v;
+
+    /*
+     * Counters for the frame being drawn, and for the last one, which may be
+     * read from other threads; stats_seq is odd while it is being written.
+     */
+    struct core_vpu_stats stats_cur;
+    struct core_vpu_stats stats;
+    atomic_uint stats_seq;
+
+    /*
+     * Called with each frame, from whichever thread draws it; the host time
+     * spent there on the render thread is not counted as the VPU's.
+     */
+    core_vpu_frame_fn frame_fn;
+    void *frame_ctx;
+    uint64_t frame_fn_ns;
 };
 
 /* Function declarations. */
 int core_vpu_init(struct core_vpu **, struct core_cpu *);
 int core_vpu_init_palette(struct core_vpu *, uint8_t *);
+int core_vpu_init_replica(struct core_vpu **, struct core_vpu *, uint8_t *);
 int core_vpu_destroy(struct core_vpu *);
+int core_vpu_thread(struct core_vpu *);
 
 void core_vpu_cycle(struct core_vpu *, int);
-void core_vpu_update(struct core_vpu *);
+void core_vpu_sync(struct core_vpu *, uint64_t);
 void core_vpu_write_fb(struct core_vpu *);
 void core_vpu_begin_vblank(struct core_vpu *);
 void core_vpu_end_vblank(struct core_vpu *);
+void core_vpu_expand_indexed(struct rgba *, const uint16_t *, int);
+void core_vpu_get_stats(struct core_vpu *, struct core_vpu_stats *);
+uint64_t core_vpu_now_ns(void);
+void core_vpu_frame_observe(struct core_vpu *, core_vpu_frame_fn, void *);
 
 uint8_t core_vpu_readb(struct core_vpu *, uint16_t);
-void core_vpu_writeb(struct core_vpu *, uint16_t, uint8_t);
+int core_vpu_writeb(struct core_vpu *, uint16_t, uint8_t);
+void core_vpu_store(struct core_vpu *, uint16_t, uint8_t);
 uint16_t core_vpu_readw(struct core_vpu *, uint16_t);
 void core_vpu_writew(struct core_vpu *, uint16_t, uint16_t);
 
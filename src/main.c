@@ -2,10 +2,18 @@
  * main.c -- Program entry point.
  *
  * Spawns the emulation and audio worker threads. The main thread then does
- * window event listening and rendering.
+ * window event listening and rendering. Headless runs have the core on the
+ * main thread instead.
  *
  */
 
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include "ui/ui.h"
 #include "core/core.h"
 
@@ -29,9 +37,90 @@ struct arg_pair
     char **argv;
 };
 
+/*
+ * The renderer variants each ROM is checked with, as up to two extra options.
+ * The first is the reference, which writes any golden image missing: the
+ * cycle renderer, which draws a pixel at a time with none of the shortcuts the
+ * others are checked for.
+ */
+static char *check_variants[][2] = {
+    { "--cycle-renderer", "--simd=none" }, { NULL }, { "--indexed" },
+    { "--block-fetch" }, { "--render-thread" }, { "--simd=none" },
+    { "--lazy-sync" },
+};
+
+/*
+ * qpra --check <dir> <frames> <rom>...
+ * Run each ROM headless with each renderer variant, for so many frames, and
+ * check them against the golden images in dir; the reference variant writes
+ * any missing. Each run is a child process of its own, so it starts from a
+ * clean slate, and one which crashes only fails itself. Returns the number of
+ * runs which failed.
+ */
+static int check(int argc, char **argv)
+{
+    char golden[4096], frames[32], what[256];
+    char *args[8], *end;
+    struct arg_pair pair = { 0, args };
+    int i, v, status, failed = 0;
+    long n;
+    pid_t pid;
+
+    /* With no frame count, a run would never end. */
+    n = strtol(argv[3], &end, 10);
+    if(*argv[3] == '\0' || *end != '\0' || n <= 0 || n > INT_MAX) {
+        fprintf(stderr, "Invalid frame count '%s'\n", argv[3]);
+        return 1;
+    }
+    snprintf(golden, sizeof(golden), "--golden=%s", argv[2]);
+    snprintf(frames, sizeof(frames), "--frames=%s", argv[3]);
+    for(i = 4; i < argc; ++i) {
+        for(v = 0; v < sizeof(check_variants) / sizeof(check_variants[0]);
+                ++v) {
+            pair.argc = 0;
+            args[pair.argc++] = argv[0];
+            args[pair.argc++] = argv[i];
+            args[pair.argc++] = "--headless";
+            args[pair.argc++] = golden;
+            args[pair.argc++] = frames;
+            if(check_variants[v][0] != NULL)
+                args[pair.argc++] = check_variants[v][0];
+            if(check_variants[v][1] != NULL)
+                args[pair.argc++] = check_variants[v][1];
+            args[pair.argc] = NULL;
+            snprintf(what, sizeof(what), "%s %s %s", argv[i],
+                     check_variants[v][0] != NULL ? check_variants[v][0] : "",
+                     check_variants[v][1] != NULL ? check_variants[v][1] : "");
+
+            fflush(stdout);
+            pid = fork();
+            if(pid == 0)
+                exit(core_entry(&pair) != NULL);
+            if(pid < 0 || waitpid(pid, &status, 0) < 0) {
+                fprintf(stderr, "Could not run %s\n", what);
+                failed += 1;
+            } else if(WIFSIGNALED(status)) {
+                printf("%s: killed by signal %d FAILED\n", what,
+                       WTERMSIG(status));
+                failed += 1;
+            } else if(WEXITSTATUS(status) != 0) {
+                failed += 1;
+            }
+        }
+    }
+    return failed;
+}
+
 int main(int argc, char **argv)
 {
     struct arg_pair pair = { argc, argv };
+    int i;
+
+    if(argc > 4 && !strcmp(argv[1], "--check"))
+        return check(argc, argv) > 0;
+    for(i = 2; i < argc; ++i)
+        if(!strcmp(argv[i], "--headless"))
+            return core_entry(&pair) != NULL;
 
     /* Setup the GUI window and components. */
     ui_init(argc, argv);
@@ -5,22 +5,86 @@
  *
  */
 
+#include <stdatomic.h>
+
 #include "ui/ui.h"
 
-pthread_mutex_t fb_lock;
-uint8_t framebuffer[256 * 224 * 4];
+/*
+ * Frames are handed from the core to the UI through three buffers: the one the
+ * core draws into, the one the UI shows, and one between them, which either
+ * side swaps for its own. UI_FB_FRESH is set while the one between holds a
+ * frame the UI has not taken yet. Until the core attaches its buffers, the UI
+ * shows its own.
+ */
+#define UI_FB_FRESH 4
+
+static uint8_t framebuffer[UI_FB_SZ];
+static uint8_t *fb_base;
+static struct ui_frame fb_info[UI_FB_NUM];
+static atomic_uint fb_middle = 1;
+static int fb_back = 2;
+static int fb_front = 0;
+static uint8_t *fb_shown = framebuffer;
+static unsigned int fb_seq;
+
+
+/*
+ * Hand the UI_FB_NUM buffers of UI_FB_SZ bytes at base over to the handoff.
+ * Called once by the core, before its first frame. Returns the buffer to draw
+ * into.
+ */
+int ui_fb_attach(uint8_t *base)
+{
+    fb_base = base;
+    return fb_back;
+}
+
+/* Record that rows [y, y + h) of the frame being drawn changed. */
+void ui_damage_fb(int y, int h)
+{
+    struct ui_frame *f = &fb_info[fb_back];
+
+    if(f->bottom <= f->top) {
+        f->top = y;
+        f->bottom = y + h;
+        return;
+    }
+    if(y < f->top)
+        f->top = y;
+    if(y + h > f->bottom)
+        f->bottom = y + h;
+}
 
-void ui_lock_fb(void)
+/*
+ * Hand the frame drawn over to the UI, saying what it holds (UI_FB_RGBA or
+ * UI_FB_INDEXED), and return the buffer to draw next.
+ */
+int ui_fb_publish(int format)
 {
-    pthread_mutex_lock(&fb_lock);
+    fb_info[fb_back].seq = ++fb_seq;
+    fb_info[fb_back].format = format;
+    fb_back = atomic_exchange(&fb_middle, fb_back | UI_FB_FRESH) & 3;
+    fb_info[fb_back].top = fb_info[fb_back].bottom = 0;
+    return fb_back;
 }
 
-void ui_unlock_fb(void)
+/*
+ * Take the newest frame handed over, if there is one since the last call: its
+ * number and changed rows are stored in f, and the buffer it is in returned
+ * (see ui_get_fb). Otherwise, return -1.
+ */
+int ui_fb_take(struct ui_frame *f)
 {
-    pthread_mutex_unlock(&fb_lock);
+    if(!(atomic_load(&fb_middle) & UI_FB_FRESH))
+        return -1;
+    fb_front = atomic_exchange(&fb_middle, fb_front) & 3;
+    fb_shown = fb_base + (size_t)fb_front * UI_FB_SZ;
+    *f = fb_info[fb_front];
+    return fb_front;
 }
 
+/* Return the buffer the UI shows. */
 void *ui_get_fb(void)
 {
-    return framebuffer;
+    return fb_shown;
 }
@@ -47,15 +47,33 @@ struct ui_window
 
 #endif
 
-extern pthread_mutex_t fb_lock;
-extern uint8_t framebuffer[256 * 224 * 4];
+/* Framebuffers handed from the core to the UI: how many, and their size. */
+#define UI_FB_NUM 3
+#define UI_FB_SZ (256 * 224 * 4)
+
+/* What a frame holds: RGBA pixels, or 16-bit fixed palette indices. */
+#define UI_FB_RGBA 0
+#define UI_FB_INDEXED 1
+
+/*
+ * A frame handed over: its number, what it holds, and the rows changed since
+ * the one before.
+ */
+struct ui_frame
+{
+    unsigned int seq;
+    int format;
+    int top, bottom;
+};
 
 void ui_init(int, char **);
 struct ui_window * ui_window_new(void);
 void ui_run(struct ui_window*);
 
-void ui_lock_fb(void);
-void ui_unlock_fb(void);
+int ui_fb_attach(uint8_t *);
+void ui_damage_fb(int, int);
+int ui_fb_publish(int);
+int ui_fb_take(struct ui_frame *);
 void *ui_get_fb(void);
 
 extern struct ui_window *window;
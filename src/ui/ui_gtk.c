@@ -13,6 +13,8 @@
 #include "ui/ui.h"
 #include "ui/ui_gtk.h"
 #include "ui/gtk_opengl.h"
+#include "core/core.h"
+#include "core/vpu/vpu.h"
 
 struct ui_window *window;
 
@@ -25,6 +27,7 @@ static int scale = 3;
 
 void ui_init_gtk(int argc, char **argv)
 {
+    uint8_t *fb = ui_get_fb();
     int i, j;
     
     /* Initialize SDL. */
@@ -34,22 +37,21 @@ void ui_init_gtk(int argc, char **argv)
     gtk_init(&argc, &argv);
 
     /* XXX: Create an initial framebuffer texture. */
-    pthread_mutex_lock(&fb_lock);
     for(j = 0; j < 224; ++j) {
         for(i = 0; i < 256; ++i) {
-            framebuffer[(j*256 + i) * 4 + 0] = i;
-            framebuffer[(j*256 + i) * 4 + 1] = i;
-            framebuffer[(j*256 + i) * 4 + 2] = i;
-            framebuffer[(j*256 + i) * 4 + 3] = 255;
+            fb[(j*256 + i) * 4 + 0] = i;
+            fb[(j*256 + i) * 4 + 1] = i;
+            fb[(j*256 + i) * 4 + 2] = i;
+            fb[(j*256 + i) * 4 + 3] = 255;
         }
     }
-    pthread_mutex_unlock(&fb_lock);
 }
 
 struct ui_window * ui_window_new_gtk(void)
 {
     GtkWidget *menubar, *filemenu, *file, *open, *close, *quit;
     GtkWidget *optmenu, *options, *emusettings, *scale2x, *scale3x;
+    GtkWidget *dbgmenu, *debug, *command;
     GtkWidget *helpmenu, *help, *doc, *about;
     GtkWidget *box;
     int attributes[] = {
@@ -81,6 +83,10 @@ struct ui_window * ui_window_new_gtk(void)
     emusettings = gtk_menu_item_new_with_label("Emulation settings");
     scale2x = gtk_menu_item_new_with_label("Scale 2X");
     scale3x = gtk_menu_item_new_with_label("Scale 3X");
+    /* Create Debug menu and items. */
+    dbgmenu = gtk_menu_new();
+    debug = gtk_menu_item_new_with_label("Debug");
+    command = gtk_menu_item_new_with_label("Command...");
     /* Create Help menu and items. */
     helpmenu = gtk_menu_new();
     help = gtk_menu_item_new_with_label("Help");
@@ -99,6 +105,10 @@ struct ui_window * ui_window_new_gtk(void)
     gtk_menu_shell_append(GTK_MENU_SHELL(optmenu), scale2x);
     gtk_menu_shell_append(GTK_MENU_SHELL(optmenu), scale3x);
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), options);
+    /* Add Debug menu to menu bar. */
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(debug), dbgmenu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(dbgmenu), command);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menubar), debug);
     /* Add Help menu to menu bar. */
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(help), helpmenu);
     gtk_menu_shell_append(GTK_MENU_SHELL(helpmenu), doc);
@@ -128,6 +138,8 @@ struct ui_window * ui_window_new_gtk(void)
             G_CALLBACK(ui_gtk_scale2x), NULL);
     g_signal_connect(G_OBJECT(scale3x), "activate",
             G_CALLBACK(ui_gtk_scale3x), NULL);
+    g_signal_connect(G_OBJECT(command), "activate",
+            G_CALLBACK(ui_gtk_command), NULL);
     g_signal_connect(window->area, "configure_event",
             G_CALLBACK(gtk_area_configure), window->window);
     g_signal_connect(window->area, "realize",
@@ -184,6 +196,27 @@ static void ui_gtk_scale3x(void)
     gtk_widget_set_size_request(window->area, 256 * scale, 224 * scale);
 }
 
+/* Ask for a debugging command, e.g. a watchpoint, and pass it to the core. */
+static void ui_gtk_command(void)
+{
+    GtkWidget *dialog, *entry;
+
+    dialog = gtk_dialog_new_with_buttons("Command",
+            GTK_WINDOW(window->window), GTK_DIALOG_MODAL,
+            "_Cancel", GTK_RESPONSE_CANCEL, "_OK", GTK_RESPONSE_OK, NULL);
+    entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "watch rw e000-ebff");
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
+    gtk_container_add(GTK_CONTAINER(gtk_dialog_get_content_area(
+            GTK_DIALOG(dialog))), entry);
+    gtk_widget_show_all(dialog);
+
+    if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_OK)
+        core_post_command(gtk_entry_get_text(GTK_ENTRY(entry)));
+    gtk_widget_destroy(dialog);
+}
+
 static void ui_gtk_quit_destroy(void)
 {
     if(!done())
@@ -202,25 +235,45 @@ static void ui_draw_init(void)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    pthread_mutex_lock(&fb_lock);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 224, 0, GL_RGBA,
-            GL_UNSIGNED_BYTE, framebuffer);
-    pthread_mutex_unlock(&fb_lock);
+            GL_UNSIGNED_BYTE, ui_get_fb());
     
     glClearColor(0.0, 0.0, 0.0, 1.0);
 }
 
 static void ui_draw_opengl(void)
 {
+    static unsigned int shown;
+    static struct rgba rgba[256 * 224];
+    struct ui_frame f;
+    uint8_t *fb;
+    int top, bottom;
+
     glClear(GL_COLOR_BUFFER_BIT);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
     glOrtho(0, 256 * scale, 0, 224 * scale, -1, 1);
     glEnable(GL_TEXTURE_2D);
-    pthread_mutex_lock(&fb_lock);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 224, GL_RGBA,
-            GL_UNSIGNED_BYTE, framebuffer);
-    pthread_mutex_unlock(&fb_lock);
+    /*
+     * Upload only new frames. If the texture holds the frame just before, only
+     * the rows which changed are needed.
+     */
+    if(ui_fb_take(&f) >= 0) {
+        fb = ui_get_fb();
+        top = 0, bottom = 224;
+        if(shown != 0 && f.seq == shown + 1)
+            top = f.top, bottom = f.bottom;
+        /* Indexed frames are expanded here, and only the rows needed. */
+        if(bottom > top && f.format == UI_FB_INDEXED) {
+            core_vpu_expand_indexed(rgba + top * 256,
+                    (uint16_t *)fb + top * 256, (bottom - top) * 256);
+            fb = (uint8_t *)rgba;
+        }
+        if(bottom > top)
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, top, 256, bottom - top,
+                    GL_RGBA, GL_UNSIGNED_BYTE, fb + top * 256 * 4);
+        shown = f.seq;
+    }
     glBegin(GL_TRIANGLE_STRIP);
         glTexCoord2f(1.0, 0.0);
         glVertex2i(256 * scale, 224 * scale);
@@ -18,6 +18,7 @@ static void ui_draw_opengl(void);
 static void ui_gtk_quit(void);
 static void ui_gtk_scale2x(void);
 static void ui_gtk_scale3x(void);
+static void ui_gtk_command(void);
 static void ui_gtk_quit_destroy(void);
 static int gtk_area_start(GtkWidget *, void *);
 static int gtk_area_configure(GtkWidget *, GdkEventConfigure *, void *);